@@ -0,0 +1,290 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "libssim.h"
+
+#define DEFAULT_RUNS 5
+#define DEFAULT_TOLERANCE 10 // Percent of MIPS lost that counts as regressed.
+#define NAME_LEN 64
+
+static const char *g_engine_names[] = {"call", "threaded", "jit"};
+
+typedef struct Program {
+  char name[NAME_LEN];
+  char *image;
+  char *input;  // NULL for an empty stdin.
+} Program;
+
+// What a child sends back after one run.
+typedef struct Run {
+  int status;       // VMStatus, or -1 if the image didn't load.
+  uint64_t steps;
+  uint64_t ns;      // Wall time of vm_run().
+} Run;
+
+// One row of the report, and of the baseline file.
+typedef struct Result {
+  char name[NAME_LEN];
+  char engine[NAME_LEN];
+  double mips;
+} Result;
+
+// Print error massage and exit.
+void error(const char *msg) {
+  printf("Error: %s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Reads "name image_file [input_file]" lines, # starts a comment.
+static Program *read_manifest(const char *file_name, size_t *num) {
+  size_t cap = 0, len = 0;
+  char *line = NULL, *name, *image, *input, *save;
+  Program *programs = NULL, *p;
+  FILE *fp;
+
+  fp = fopen(file_name, "r");
+  if (!fp) error("Can't open manifest file!");
+  *num = 0;
+  while (-1 != getline(&line, &len, fp)) {
+    char *comment = strchr(line, '#');
+
+    if (comment) *comment = '\0';
+    name = strtok_r(line, " \t\r\n", &save);
+    if (!name) continue;
+    image = strtok_r(NULL, " \t\r\n", &save);
+    if (!image) error("Manifest line without an image!");
+    input = strtok_r(NULL, " \t\r\n", &save);
+
+    if (*num == cap) {
+      cap = cap ? cap * 2 : 16;
+      p = realloc(programs, cap * sizeof(Program));
+      if (!p) error("Out of memory!");
+      programs = p;
+    }
+    p = &programs[(*num)++];
+    snprintf(p->name, NAME_LEN, "%s", name);
+    p->image = strdup(image);
+    p->input = input ? strdup(input) : NULL;
+    if (!p->image || (input && !p->input)) error("Out of memory!");
+  }
+  free(line);
+  fclose(fp);
+  return programs;
+}
+
+// Runs the program once in a child process, so its peak RSS is its own.
+// Returns non-zero if the child didn't report back.
+static int run_once(const Program *program, VMEngine engine, Run *run,
+                    long *rss_kb) {
+  struct rusage usage;
+  int fds[2], wstatus;
+  pid_t pid;
+
+  if (0 != pipe(fds)) return -1;
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0) return -1;
+  if (!pid) {
+    FILE *in = fopen(program->input ? program->input : "/dev/null", "rb");
+    FILE *out = fopen("/dev/null", "wb");
+    VM *vm = vm_create();
+    uint64_t start;
+
+    close(fds[0]);
+    memset(run, 0, sizeof(Run));
+    run->status = -1;
+    if (in && out && vm) {
+      vm_set_engine(vm, engine);
+      vm_set_io(vm, in, out);
+      if (0 == vm_load(vm, program->image)) {
+        start = now_ns();
+        run->status = vm_run(vm, 0);
+        run->ns = now_ns() - start;
+        run->steps = vm_steps(vm);
+      }
+    }
+    if (sizeof(Run) != write(fds[1], run, sizeof(Run))) _exit(EXIT_FAILURE);
+    _exit(0);
+  }
+
+  close(fds[1]);
+  if (sizeof(Run) != read(fds[0], run, sizeof(Run))) run->status = -1;
+  close(fds[0]);
+  if (pid != wait4(pid, &wstatus, 0, &usage)) return -1;
+  *rss_kb = usage.ru_maxrss;
+  return -1 == run->status ? -1 : 0;
+}
+
+static int compare_ns(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static Result *read_baseline(const char *file_name, size_t *num) {
+  Result *results = NULL, *r, row;
+  size_t cap = 0;
+  FILE *fp;
+
+  *num = 0;
+  fp = fopen(file_name, "r");
+  if (!fp) error("Can't open baseline file!");
+  while (3 == fscanf(fp, "%63s %63s %lf", row.name, row.engine, &row.mips)) {
+    if (*num == cap) {
+      cap = cap ? cap * 2 : 32;
+      r = realloc(results, cap * sizeof(Result));
+      if (!r) error("Out of memory!");
+      results = r;
+    }
+    results[(*num)++] = row;
+  }
+  fclose(fp);
+  return results;
+}
+
+static const Result *find_result(const Result *results, size_t num,
+                                 const char *name, const char *engine) {
+  for (size_t k = 0; k < num; ++k)
+    if (!strcmp(results[k].name, name) && !strcmp(results[k].engine, engine))
+      return &results[k];
+  return NULL;
+}
+
+void usage_and_die() {
+  printf("Usage: bench [--runs=n] [--engine=call|threaded|jit]\n"
+         "             [--baseline=file [--tolerance=percent]] "
+         "[--save=file] manifest_file\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  const char *manifest = NULL, *baseline_file = NULL, *save_file = NULL;
+  const char *only_engine = NULL;
+  int runs = DEFAULT_RUNS;
+  double tolerance = DEFAULT_TOLERANCE;
+  Program *programs;
+  size_t program_num, baseline_num = 0, result_num = 0;
+  Result *baseline = NULL, *results;
+  uint64_t *times;
+  int regressed = 0;
+  FILE *save = NULL;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strncmp(argv[i], "--runs=", 7)) {
+      runs = atoi(argv[i] + 7);
+    } else if (!strncmp(argv[i], "--engine=", 9)) {
+      only_engine = argv[i] + 9;
+    } else if (!strncmp(argv[i], "--baseline=", 11)) {
+      baseline_file = argv[i] + 11;
+    } else if (!strncmp(argv[i], "--tolerance=", 12)) {
+      tolerance = atof(argv[i] + 12);
+    } else if (!strncmp(argv[i], "--save=", 7)) {
+      save_file = argv[i] + 7;
+    } else if (!strncmp(argv[i], "--", 2) || manifest) {
+      usage_and_die();
+    } else {
+      manifest = argv[i];
+    }
+  }
+  if (!manifest || runs < 1) usage_and_die();
+
+  programs = read_manifest(manifest, &program_num);
+  if (baseline_file) baseline = read_baseline(baseline_file, &baseline_num);
+  results = calloc(program_num * 3, sizeof(Result));
+  times = calloc(runs, sizeof(uint64_t));
+  if (!results || !times) error("Out of memory!");
+
+  printf("%-10s %-9s %12s %10s %9s %10s", "program", "engine", "steps",
+         "wall ms", "MIPS", "RSS KB");
+  if (baseline) printf(" %9s %8s", "baseline", "change");
+  putchar('\n');
+
+  for (size_t p = 0; p < program_num; ++p) {
+    for (int e = VM_ENGINE_CALL; e <= VM_ENGINE_JIT; ++e) {
+      VM *probe = vm_create();
+      bool supported = probe && 0 == vm_set_engine(probe, e);
+      Result *result = &results[result_num];
+      const Result *base;
+      uint64_t steps = 0;
+      long rss_kb = 0, max_rss_kb = 0;
+      Run run;
+      int k;
+
+      vm_destroy(probe);
+      if (!supported) continue;
+      if (only_engine && strcmp(only_engine, g_engine_names[e])) continue;
+
+      for (k = 0; k < runs; ++k) {
+        if (0 != run_once(&programs[p], e, &run, &rss_kb)) break;
+        times[k] = run.ns;
+        steps = run.steps;
+        if (rss_kb > max_rss_kb) max_rss_kb = rss_kb;
+      }
+      if (k < runs) {
+        printf("%-10s %-9s can't be loaded or run!\n", programs[p].name,
+               g_engine_names[e]);
+        regressed = 1;
+        continue;
+      }
+
+      // The median run, the others are noise one way or the other.
+      qsort(times, runs, sizeof(uint64_t), compare_ns);
+      snprintf(result->name, NAME_LEN, "%s", programs[p].name);
+      snprintf(result->engine, NAME_LEN, "%s", g_engine_names[e]);
+      result->mips = times[runs / 2] ?
+                     steps * 1000.0 / times[runs / 2] : 0;
+      ++result_num;
+
+      printf("%-10s %-9s %12llu %10.2f %9.1f %10ld", result->name,
+             result->engine, (unsigned long long)steps,
+             times[runs / 2] / 1e6, result->mips, max_rss_kb);
+      base = find_result(baseline, baseline_num, result->name,
+                         result->engine);
+      if (base && base->mips > 0) {
+        double change = 100.0 * (result->mips - base->mips) / base->mips;
+
+        printf(" %9.1f %+7.1f%%", base->mips, change);
+        if (change < -tolerance) {
+          printf("  REGRESSED");
+          regressed = 1;
+        }
+      }
+      putchar('\n');
+    }
+  }
+
+  if (save_file) {
+    save = fopen(save_file, "w");
+    if (!save) error("Can't open baseline file!");
+    for (size_t k = 0; k < result_num; ++k)
+      fprintf(save, "%s %s %.1f\n", results[k].name, results[k].engine,
+              results[k].mips);
+    fclose(save);
+  }
+
+  for (size_t p = 0; p < program_num; ++p) {
+    free(programs[p].image);
+    free(programs[p].input);
+  }
+  free(programs);
+  free(baseline);
+  free(results);
+  free(times);
+  return regressed ? EXIT_FAILURE : 0;
+}
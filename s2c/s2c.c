@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define ADDR_MASK ((uint32_t)0xffffff)
+#define IMMEDIATE_MASK ((uint32_t)0xffff)
+#define PORT_MASK ((uint32_t)0xff)
+
+// Shorthands.
+#define OPCODE(ir) ((ir) >> 27)
+#define REG0(ir) (((ir)>>24) & 0x7)
+#define REG1(ir) (((ir)>>20) & 0xf)
+#define REG2(ir) (((ir)>>16) & 0xf)
+#define ADDR(ir) ((ir) & ADDR_MASK)
+#define IMMEDIATE(ir) (uint16_t)((ir) & IMMEDIATE_MASK)
+#define PORT(ir) ((ir) & PORT_MASK)
+
+// Instruction codes.
+enum {
+  OP_HLT, OP_JMP, OP_CJMP, OP_OJMP, OP_CALL,
+  OP_RET, OP_PUSH, OP_POP, OP_LOADB, OP_LOADW,
+  OP_STOREB, OP_STOREW, OP_LOADI, OP_NOP, OP_IN,
+  OP_OUT, OP_ADD, OP_ADDI, OP_SUB, OP_SUBI,
+  OP_MUL, OP_DIV, OP_AND, OP_OR, OP_NOR,
+  OP_NOTB, OP_SAL, OP_SAR, OP_EQU, OP_LT,
+  OP_LTE, OP_NOTC,
+};
+
+static const char *g_names[] = {
+  "HLT", "JMP", "CJMP", "OJMP", "CALL",
+  "RET", "PUSH", "POP", "LOADB", "LOADW",
+  "STOREB", "STOREW", "LOADI", "NOP", "IN",
+  "OUT", "ADD", "ADDI", "SUB", "SUBI",
+  "MUL", "DIV", "AND", "OR", "NOR",
+  "NOTB", "SAL", "SAR", "EQU", "LT",
+  "LTE", "NOTC"};
+
+// Global variables.
+static uint8_t *g_ds, *g_cs;
+static uint32_t g_ds_size, g_cs_size;
+static FILE *g_fout;
+
+static const char *g_includes =
+  "#include <stdlib.h>\n"
+  "#include <stdio.h>\n"
+  "#include <string.h>\n"
+  "#include <stdint.h>\n"
+  "\n"
+  "#ifdef __GNUC__\n"
+  "#pragma GCC diagnostic ignored \"-Wunused-label\"\n"
+  "#endif\n"
+  "\n";
+
+// Everything the generated program needs besides DS and main().
+// The semantics follow the do_* handlers of ssim.
+static const char *g_prologue =
+  "#define STACK_SIZE (1 << 20)\n"
+  "#define ES_SIZE (1 << 20)\n"
+  "\n"
+  "static int16_t R[8];\n"
+  "static uint8_t SS[STACK_SIZE], ES[ES_SIZE];\n"
+  "static uint32_t SS_TOP, ES_TOP;\n"
+  "static unsigned OF, CF;\n"
+    "\n"
+  "static void fail(uint32_t pc) {\n"
+  "  printf(\"PC: %d\\n\", pc);\n"
+  "  printf(\"Error: %s\\n\", \"Execution error!\");\n"
+  "  exit(EXIT_FAILURE);\n"
+  "}\n"
+  "\n"
+  "static inline void check_overflow(int32_t result) {\n"
+  "  OF = result < (int16_t)(0x8000) || result > (int16_t)(0x7fff);\n"
+  "}\n"
+  "\n"
+  "static inline int16_t sar(int16_t a, int16_t n) {\n"
+  "  uint16_t result = a;\n"
+  "  for (int i = 0; i < n && i < 16; ++i) {\n"
+  "    result >>= 1;\n"
+  "    result |= (result << 1) & 0x8000;\n"
+  "  }\n"
+  "  return result;\n"
+  "}\n"
+  "\n"
+  "static inline void push(int16_t val, uint32_t pc) {\n"
+  "  if (SS_TOP + 2 > STACK_SIZE) {\n"
+  "    puts(\"Stack overflow!\");\n"
+  "    fail(pc);\n"
+  "  }\n"
+  "  memcpy(SS + SS_TOP, &val, 2);\n"
+  "  SS_TOP += 2;\n"
+  "}\n"
+  "\n"
+  "static inline int16_t pop(uint32_t pc) {\n"
+  "  int16_t val;\n"
+  "  if (SS_TOP < 2) {\n"
+  "    puts(\"Stack underflow!\");\n"
+  "    fail(pc);\n"
+  "  }\n"
+  "  SS_TOP -= 2;\n"
+  "  memcpy(&val, SS + SS_TOP, 2);\n"
+  "  return val;\n"
+  "}\n"
+  "\n"
+  "// Saves general_regs, PC and PSW (2*8+4+4 = 24).\n"
+  "static inline void call(uint32_t pc) {\n"
+  "  uint32_t psw = OF | CF << 1;\n"
+  "  if (ES_TOP + 24 > ES_SIZE) {\n"
+  "    puts(\"Extended-Stack overflow!\");\n"
+  "    fail(pc);\n"
+  "  }\n"
+  "  memcpy(ES + ES_TOP, R, 16);\n"
+  "  memcpy(ES + ES_TOP + 16, &pc, 4);\n"
+  "  memcpy(ES + ES_TOP + 20, &psw, 4);\n"
+  "  ES_TOP += 24;\n"
+  "}\n"
+  "\n"
+  "// Returns the PC of the CALL.\n"
+  "static inline uint32_t ret() {\n"
+  "  uint32_t pc, psw;\n"
+  "  ES_TOP -= 24;\n"
+  "  memcpy(R, ES + ES_TOP, 16);\n"
+  "  memcpy(&pc, ES + ES_TOP + 16, 4);\n"
+  "  memcpy(&psw, ES + ES_TOP + 20, 4);\n"
+  "  OF = psw & 1;\n"
+  "  CF = (psw >> 1) & 1;\n"
+  "  return pc;\n"
+  "}\n"
+  "\n"
+  "static inline int16_t loadw(uint32_t offset) {\n"
+  "  int16_t val;\n"
+  "  memcpy(&val, DS + offset, 2);\n"
+  "  return val;\n"
+  "}\n"
+  "\n"
+  "static inline void storew(uint32_t offset, int16_t val) {\n"
+  "  memcpy(DS + offset, &val, 2);\n"
+  "}\n"
+  "\n";
+
+// Print error massage and exit.
+void error(char *msg) {
+  printf("Error: %s\n", msg);
+  exit(EXIT_FAILURE);
+}
+
+// Reads the image written by sas.
+void load_image(char *file_name) {
+  FILE *fp;
+
+  fp = fopen(file_name, "rb");
+  if (!fp) error("Can't open input file!");
+  if (1 != fread(&g_ds_size, 4, 1, fp) || 1 != fread(&g_cs_size, 4, 1, fp))
+    error("Input file corrupted!");
+
+  g_ds = malloc(g_ds_size + 1);
+  g_cs = malloc(g_cs_size + 1);
+  if (!g_ds || !g_cs) error("Out of memory!");
+  if (g_ds_size && 1 != fread(g_ds, g_ds_size, 1, fp))
+    error("Input file corrupted!");
+  if (g_cs_size && 1 != fread(g_cs, g_cs_size, 1, fp))
+    error("Input file corrupted!");
+  g_cs_size &= ~(uint32_t)3; // Trailing bytes can never be executed.
+
+  fclose(fp);
+}
+
+// Emits the initial content of DS.
+void emit_ds() {
+  fprintf(g_fout, "static uint8_t DS[%u] = {", g_ds_size ? g_ds_size : 1);
+  for (uint32_t i = 0; i < g_ds_size; ++i)
+    fprintf(g_fout, "%s%u,", i % 16 ? "" : "\n  ", g_ds[i]);
+  fprintf(g_fout, "\n};\n\n");
+}
+
+// Emits a jump, targets that aren't instructions go to bad_pc like in ssim.
+void emit_goto(uint32_t addr) {
+  if (addr % 4 || addr >= g_cs_size)
+    fprintf(g_fout, "goto bad_pc;");
+  else
+    fprintf(g_fout, "goto L%u;", addr);
+}
+
+// Emits the statements for the instruction at pc.
+// Returns non-zero on error.
+int emit_instr(uint32_t pc) {
+  uint32_t ir = *(uint32_t *)(g_cs + pc);
+  uint32_t opcode = OPCODE(ir);
+  uint32_t r0 = REG0(ir), r1 = REG1(ir), r2 = REG2(ir);
+
+  fprintf(g_fout, "L%u: /* %s */\n  ", pc, g_names[opcode]);
+
+  switch (opcode) {
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_AND:
+    case OP_OR: case OP_NOR: case OP_SAL: case OP_SAR:
+      if (r2 > 7) return -1;
+      // Fall through.
+    case OP_NOTB: case OP_EQU: case OP_LT: case OP_LTE:
+      if (r1 > 7) return -1;
+      break;
+    default:
+      break;
+  }
+
+  // Instructions which can't write Z fail.
+  switch (opcode) {
+    case OP_POP: case OP_LOADW: case OP_LOADI: case OP_IN: case OP_ADD:
+    case OP_ADDI: case OP_SUB: case OP_SUBI: case OP_MUL: case OP_DIV:
+    case OP_AND: case OP_OR: case OP_NOR: case OP_NOTB: case OP_SAL:
+    case OP_SAR:
+      if (0 == r0) {
+        fprintf(g_fout, "fail(%u);\n", pc);
+        return 0;
+      }
+      break;
+    default:
+      break;
+  }
+
+  switch (opcode) {
+    case OP_HLT:
+      fprintf(g_fout, "return 0;");
+      break;
+    case OP_JMP:
+      emit_goto(ADDR(ir));
+      break;
+    case OP_CJMP:
+      fprintf(g_fout, "if (CF) ");
+      emit_goto(ADDR(ir));
+      break;
+    case OP_OJMP:
+      fprintf(g_fout, "if (OF) ");
+      emit_goto(ADDR(ir));
+      break;
+    case OP_CALL:
+      fprintf(g_fout, "call(%u); ", pc);
+      emit_goto(ADDR(ir));
+      break;
+    case OP_RET:
+      // The outter most RET. Program exits normally.
+      fprintf(g_fout, "if (ES_TOP < 24) return 0;\n  goto ret_table;");
+      break;
+    case OP_PUSH:
+      fprintf(g_fout, "push(R[%u], %u);", r0, pc);
+      break;
+    case OP_POP:
+      fprintf(g_fout, "R[%u] = pop(%u);", r0, pc);
+      break;
+    case OP_LOADB:
+      fprintf(g_fout, "R[%u] = DS[%uu + R[7]];", r0, ADDR(ir));
+      break;
+    case OP_LOADW:
+      fprintf(g_fout, "R[%u] = loadw(%uu + R[7]*2);", r0, ADDR(ir));
+      break;
+    case OP_STOREB:
+      fprintf(g_fout, "DS[%uu + R[7]] = R[%u];", ADDR(ir), r0);
+      break;
+    case OP_STOREW:
+      fprintf(g_fout, "storew(%uu + R[7]*2, R[%u]);", ADDR(ir), r0);
+      break;
+    case OP_LOADI:
+      fprintf(g_fout, "R[%u] = (uint16_t)%u;", r0, IMMEDIATE(ir));
+      break;
+    case OP_NOP:
+      fprintf(g_fout, ";");
+      break;
+    case OP_IN:
+      if (PORT(ir) != 0)
+        fprintf(g_fout, "puts(\"Invalid input port!\"); fail(%u);", pc);
+      else
+        fprintf(g_fout, "R[%u] = getchar();", r0);
+      break;
+    case OP_OUT:
+      if (PORT(ir) != 15)
+        fprintf(g_fout, "puts(\"Invalid output port!\"); fail(%u);", pc);
+      else
+        fprintf(g_fout, "putchar(R[%u]); fflush(stdout);", r0);
+      break;
+    case OP_ADD:
+      fprintf(g_fout, "result = R[%u] + R[%u]; check_overflow(result); "
+              "R[%u] = result;", r1, r2, r0);
+      break;
+    case OP_ADDI:
+      fprintf(g_fout, "result = R[%u] + %u; check_overflow(result); "
+              "R[%u] = result;", r0, IMMEDIATE(ir), r0);
+      break;
+    case OP_SUB:
+      fprintf(g_fout, "result = R[%u] - R[%u]; check_overflow(result); "
+              "R[%u] = result;", r1, r2, r0);
+      break;
+    case OP_SUBI:
+      fprintf(g_fout, "result = R[%u] - %u; check_overflow(result); "
+              "R[%u] = result;", r0, IMMEDIATE(ir), r0);
+      break;
+    case OP_MUL:
+      fprintf(g_fout, "result = R[%u] * R[%u]; check_overflow(result); "
+              "R[%u] = result;", r1, r2, r0);
+      break;
+    case OP_DIV:
+      fprintf(g_fout, "if (R[%u] == 0) { puts(\"0-div!\"); fail(%u); }\n  "
+              "result = R[%u] / R[%u]; check_overflow(result); "
+              "R[%u] = result;", r2, pc, r1, r2, r0);
+      break;
+    case OP_AND:
+      fprintf(g_fout, "R[%u] = R[%u] & R[%u];", r0, r1, r2);
+      break;
+    case OP_OR:
+      fprintf(g_fout, "R[%u] = R[%u] | R[%u];", r0, r1, r2);
+      break;
+    case OP_NOR:
+      fprintf(g_fout, "R[%u] = R[%u] ^ R[%u];", r0, r1, r2);
+      break;
+    case OP_NOTB:
+      fprintf(g_fout, "R[%u] = ~R[%u];", r0, r1);
+      break;
+    case OP_SAL:
+      fprintf(g_fout, "R[%u] = R[%u] << R[%u];", r0, r1, r2);
+      break;
+    case OP_SAR:
+      fprintf(g_fout, "R[%u] = sar(R[%u], R[%u]);", r0, r1, r2);
+      break;
+    case OP_EQU:
+      fprintf(g_fout, "CF = R[%u] == R[%u];", r0, r1);
+      break;
+    case OP_LT:
+      fprintf(g_fout, "CF = R[%u] < R[%u];", r0, r1);
+      break;
+    case OP_LTE:
+      fprintf(g_fout, "CF = R[%u] <= R[%u];", r0, r1);
+      break;
+    case OP_NOTC:
+      fprintf(g_fout, "CF = !CF;");
+      break;
+  }
+  fprintf(g_fout, "\n");
+  return 0;
+}
+
+// Emits the program: one label per instruction, and a switch over the
+// return addresses for RET.
+void emit_program() {
+  fprintf(g_fout, "int main() {\n  int32_t result;\n  (void)result;\n\n");
+  for (uint32_t pc = 0; pc < g_cs_size; pc += 4) {
+    if (0 != emit_instr(pc)) {
+      printf("PC: %d\n", pc);
+      error("Invalid register!");
+    }
+  }
+  fprintf(g_fout, "  goto bad_pc;\n\n");
+
+  fprintf(g_fout, "ret_table:\n  switch (ret()) {\n");
+  for (uint32_t pc = 0; pc < g_cs_size; pc += 4) {
+    if (OP_CALL == OPCODE(*(uint32_t *)(g_cs + pc))) {
+      fprintf(g_fout, "    case %u: goto L%u;\n", pc, pc + 4);
+    }
+  }
+  fprintf(g_fout, "  }\n");
+
+  // Sits right after the last instruction, and is also the destination of
+  // jumps that don't land on an instruction.
+  fprintf(g_fout, "\nL%u:\nbad_pc:\n", g_cs_size);
+  fprintf(g_fout, "  puts(\"PC out of code segment!\");\n");
+  fprintf(g_fout, "  fail(%u);\n", g_cs_size);
+  fprintf(g_fout, "  return 0;\n}\n");
+}
+
+void usage_and_die() {
+  puts("Usage: s2c image_file out_file");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) usage_and_die();
+
+  load_image(argv[1]);
+  g_fout = fopen(argv[2], "w");
+  if (!g_fout) error("Can't open output file!");
+
+  fprintf(g_fout, "// Translated from %s by s2c.\n\n", argv[1]);
+  fputs(g_includes, g_fout);
+  emit_ds();
+  fputs(g_prologue, g_fout);
+  emit_program();
+
+  fclose(g_fout);
+  free(g_ds);
+  free(g_cs);
+  puts("Translate Success");
+  return 0;
+}
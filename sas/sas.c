@@ -259,13 +259,20 @@ int process_string_const(char **line) {
   return len;
 }
 
+// Write n elements of zeros.
+void write_zeros(size_t elem_size, int n) {
+  int zero = 0;
+
+  for (int i = 0; i < n; ++i) fwrite(&zero, elem_size, 1, g_fout);
+}
+
 // Process data definitions.
 // If step == 1, this function only calculates the needed space.
 int process_data(char *line, char *keyword, int step) {
   char symbol[SYMBOL_LEN], *symbol_ptr = symbol;
   bool has_size = false;  // Has the optional []?
   int elem_num = 1;
-  int init_val, zero = 0;
+  int init_val;
   size_t elem_size;
   char *curr_ptr;
 
@@ -331,7 +338,7 @@ int process_data(char *line, char *keyword, int step) {
         int val_num = process_bracket(&curr_ptr, elem_size);
         if (val_num < 0 || val_num > elem_num) return -1;
         // Fill out the rest with zeros.
-        fwrite(&zero, elem_size, elem_num - val_num, g_fout);
+        write_zeros(elem_size, elem_num - val_num);
         
       } else if ('\"' == *curr_ptr && 1 == elem_size) { // String
         int val_num = process_string_const(&curr_ptr);
@@ -344,7 +351,7 @@ int process_data(char *line, char *keyword, int step) {
           return -1;
         }
         // Fill out the rest with zeros.
-        fwrite(&zero, elem_size, elem_num - val_num, g_fout);
+        write_zeros(elem_size, elem_num - val_num);
         
       } else { // Illegal syntax.
         puts("Illegal data syntax");
@@ -352,7 +359,7 @@ int process_data(char *line, char *keyword, int step) {
       }
       
     } else { // No initializers, fill out with zeros.
-      fwrite(&zero, elem_size, elem_num, g_fout);
+      write_zeros(elem_size, elem_num);
     }
 
     // Process ending.
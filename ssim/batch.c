@@ -0,0 +1,296 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "batch.h"
+
+typedef struct Job {
+  char *image;
+  char *input;  // NULL for an empty stdin.
+
+  const char *status;
+  int exit;
+  uint64_t steps;
+  char *output; // Everything the job wrote to stdout.
+  size_t output_size;
+} Job;
+
+typedef struct Batch Batch;
+
+// Each worker owns a range of jobs. It takes jobs from the front of its own
+// range, and when that runs out, steals the back half of somebody else's.
+typedef struct Worker {
+  pthread_mutex_t lock;
+  size_t lo, hi; // Jobs [lo, hi) are left.
+  pthread_t thread;
+  int id;
+  Batch *batch;
+} Worker;
+
+struct Batch {
+  const BatchOptions *options;
+  Job *jobs;
+  size_t job_num;
+  Worker *workers;
+  int worker_num;
+};
+
+// Reads the manifest. Returns non-zero on error.
+static int read_manifest(Batch *batch, const char *file_name) {
+  size_t cap = 0, len = 0;
+  char *line = NULL, *image, *input, *save;
+  FILE *fp;
+  Job *jobs;
+
+  fp = fopen(file_name, "r");
+  if (!fp) {
+    printf("Error: Can't open manifest file!\n");
+    return -1;
+  }
+
+  while (-1 != getline(&line, &len, fp)) {
+    char *comment = strchr(line, '#');
+
+    if (comment) *comment = '\0';
+    image = strtok_r(line, " \t\r\n", &save);
+    if (!image) continue;
+    input = strtok_r(NULL, " \t\r\n", &save);
+
+    if (batch->job_num == cap) {
+      cap = cap ? cap * 2 : 64;
+      jobs = realloc(batch->jobs, cap * sizeof(Job));
+      if (!jobs) goto no_memory;
+      batch->jobs = jobs;
+    }
+    memset(&batch->jobs[batch->job_num], 0, sizeof(Job));
+    batch->jobs[batch->job_num].image = strdup(image);
+    if (!batch->jobs[batch->job_num].image) goto no_memory;
+    if (input) {
+      batch->jobs[batch->job_num].input = strdup(input);
+      if (!batch->jobs[batch->job_num].input) goto no_memory;
+    }
+    ++batch->job_num;
+  }
+
+  free(line);
+  fclose(fp);
+  return 0;
+
+no_memory:
+  free(line);
+  fclose(fp);
+  printf("Error: Out of memory!\n");
+  return -1;
+}
+
+// Runs one job, with its stdout captured in memory.
+static void run_job(Batch *batch, Job *job) {
+  const BatchOptions *options = batch->options;
+  FILE *in, *out;
+  VM *vm = NULL;
+
+  job->status = "error";
+  job->exit = EXIT_ERROR;
+  out = open_memstream(&job->output, &job->output_size);
+  if (!out) return;
+
+  in = fopen(job->input ? job->input : "/dev/null", "rb");
+  if (!in) {
+    fprintf(out, "Error: Can't open input file!\n");
+    goto done;
+  }
+
+  vm = vm_create();
+  if (!vm) {
+    fprintf(out, "Error: Out of memory!\n");
+    goto done;
+  }
+  vm_set_engine(vm, options->engine);
+  vm_set_fuse(vm, options->fuse);
+  vm_set_stack_sizes(vm, options->ss_size, options->es_size);
+  vm_set_io(vm, in, out);
+  vm_set_flush_interval(vm, -1); // Nobody watches it.
+  if (0 != vm_load(vm, job->image)) {
+    fprintf(out, "Error: %s\n", vm_error(vm));
+    goto done;
+  }
+
+  switch (vm_run(vm, options->max_steps)) {
+    case VM_STOPPED:
+      job->status = "ok";
+      job->exit = EXIT_OK;
+      break;
+    case VM_RUNNING:
+    case VM_BREAK: // No breakpoints are set, and IN isn't fed.
+    case VM_WAITING:
+      job->status = "limit";
+      job->exit = EXIT_LIMIT;
+      break;
+    case VM_ERROR:
+      if (vm_error(vm)) fprintf(out, "%s\n", vm_error(vm));
+      fprintf(out, "PC: %d\n", vm_pc(vm));
+      fprintf(out, "Error: Execution error!\n");
+      break;
+  }
+  job->steps = vm_steps(vm);
+
+done:
+  vm_destroy(vm);
+  if (in) fclose(in);
+  fclose(out);
+}
+
+// Takes the next job of the worker's own range.
+static bool take_job(Worker *worker, size_t *job) {
+  bool found = false;
+
+  pthread_mutex_lock(&worker->lock);
+  if (worker->lo < worker->hi) {
+    *job = worker->lo++;
+    found = true;
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return found;
+}
+
+// Steals the back half of another worker's range, keeps the first job of it
+// and makes the rest the worker's own range.
+static bool steal_job(Worker *worker, size_t *job) {
+  Batch *batch = worker->batch;
+  size_t lo = 0, hi = 0;
+
+  for (int k = 1; k < batch->worker_num && lo == hi; ++k) {
+    Worker *victim = &batch->workers[(worker->id + k) % batch->worker_num];
+
+    pthread_mutex_lock(&victim->lock);
+    if (victim->lo < victim->hi) {
+      hi = victim->hi;
+      lo = hi - (victim->hi - victim->lo + 1) / 2;
+      victim->hi = lo;
+    }
+    pthread_mutex_unlock(&victim->lock);
+  }
+  if (lo == hi) return false;
+
+  pthread_mutex_lock(&worker->lock);
+  worker->lo = lo + 1;
+  worker->hi = hi;
+  pthread_mutex_unlock(&worker->lock);
+  *job = lo;
+  return true;
+}
+
+static void *work(void *arg) {
+  Worker *worker = arg;
+  size_t job;
+
+  while (take_job(worker, &job) || steal_job(worker, &job))
+    run_job(worker->batch, &worker->batch->jobs[job]);
+  return NULL;
+}
+
+// Writes s with the characters that would break the line escaped.
+static void write_escaped(FILE *fp, const char *s, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    unsigned char c = s[i];
+
+    switch (c) {
+      case '\\': fputs("\\\\", fp); break;
+      case '\t': fputs("\\t", fp); break;
+      case '\n': fputs("\\n", fp); break;
+      case '\r': fputs("\\r", fp); break;
+      default:
+        if (isprint(c))
+          putc(c, fp);
+        else
+          fprintf(fp, "\\x%02x", c);
+    }
+  }
+}
+
+// One line per job:
+// index  status  exit  steps  image  input  stdout
+static int write_summary(Batch *batch, const char *file_name) {
+  FILE *fp = fopen(file_name, "w");
+
+  if (!fp) {
+    printf("Error: Can't open summary file!\n");
+    return -1;
+  }
+  for (size_t i = 0; i < batch->job_num; ++i) {
+    Job *job = &batch->jobs[i];
+
+    fprintf(fp, "%zu\t%s\t%d\t%llu\t%s\t%s\t", i, job->status, job->exit,
+            (unsigned long long)job->steps, job->image,
+            job->input ? job->input : "-");
+    write_escaped(fp, job->output, job->output_size);
+    putc('\n', fp);
+  }
+  fclose(fp);
+  return 0;
+}
+
+static void destroy_batch(Batch *batch) {
+  for (size_t i = 0; i < batch->job_num; ++i) {
+    free(batch->jobs[i].image);
+    free(batch->jobs[i].input);
+    free(batch->jobs[i].output);
+  }
+  free(batch->jobs);
+  free(batch->workers);
+}
+
+int run_batch(const BatchOptions *options) {
+  Batch batch;
+  int started = 0;
+  int ret = -1;
+
+  memset(&batch, 0, sizeof(Batch));
+  batch.options = options;
+  if (0 != read_manifest(&batch, options->manifest)) goto done;
+
+  batch.worker_num = options->threads;
+  if (batch.worker_num <= 0) batch.worker_num = sysconf(_SC_NPROCESSORS_ONLN);
+  if (batch.worker_num <= 0) batch.worker_num = 1;
+  if ((size_t)batch.worker_num > batch.job_num)
+    batch.worker_num = batch.job_num ? batch.job_num : 1;
+
+  batch.workers = calloc(batch.worker_num, sizeof(Worker));
+  if (!batch.workers) {
+    printf("Error: Out of memory!\n");
+    goto done;
+  }
+
+  // Deal the jobs out in contiguous ranges, stealing evens out the rest.
+  for (int k = 0; k < batch.worker_num; ++k) {
+    Worker *worker = &batch.workers[k];
+
+    pthread_mutex_init(&worker->lock, NULL);
+    worker->id = k;
+    worker->batch = &batch;
+    worker->lo = batch.job_num * k / batch.worker_num;
+    worker->hi = batch.job_num * (k + 1) / batch.worker_num;
+  }
+  for (started = 0; started < batch.worker_num; ++started)
+    if (0 != pthread_create(&batch.workers[started].thread, NULL, work,
+                            &batch.workers[started]))
+      break;
+  // Whatever was dealt to workers that didn't start gets stolen.
+  if (0 == started) work(&batch.workers[0]);
+  for (int k = 0; k < started; ++k)
+    pthread_join(batch.workers[k].thread, NULL);
+  for (int k = 0; k < batch.worker_num; ++k)
+    pthread_mutex_destroy(&batch.workers[k].lock);
+
+  ret = write_summary(&batch, options->summary);
+
+done:
+  destroy_batch(&batch);
+  return ret;
+}
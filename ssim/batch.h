@@ -0,0 +1,30 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libssim.h"
+
+// Exit status of ssim, and of a batch job.
+#define EXIT_OK 0
+#define EXIT_ERROR 1
+#define EXIT_LIMIT 2  // Ran out of instructions or time.
+
+typedef struct BatchOptions {
+  const char *manifest; // One "image_file [input_file]" per line.
+  const char *summary;  // Where the results go.
+  int threads;          // 0 for one per core.
+  uint64_t max_steps;   // Per job, 0 for no limit.
+  VMEngine engine;
+  bool fuse;
+  size_t ss_size;       // 0 for the default.
+  size_t es_size;
+} BatchOptions;
+
+// Runs every job of the manifest on a pool of threads, and writes the results
+// to the summary file in the order of the manifest.
+// Returns non-zero if the batch itself couldn't run, printing why.
+int run_batch(const BatchOptions *options);
+
+#endif
@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+#include "counters.h"
+#include "profile.h"
+
+#ifdef HAVE_COUNTERS
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define CALIBRATE_READS 1000
+
+static const struct {
+  uint32_t type;
+  uint64_t config;
+  const char *name;
+} g_events[COUNTER_NUM] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses"},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses"},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock ns"},
+};
+
+// Counts the user space of this thread only.
+static int open_event(int k) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = g_events[k].type;
+  attr.config = g_events[k].config;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+Counters *counters_create() {
+  Counters *counters = calloc(1, sizeof(Counters));
+  uint64_t before[COUNTER_NUM], after[COUNTER_NUM];
+  size_t page = sysconf(_SC_PAGESIZE);
+  bool any = false;
+
+  if (!counters) return NULL;
+  for (int k = 0; k < COUNTER_NUM; ++k) {
+    counters->fds[k] = open_event(k);
+    if (counters->fds[k] < 0) continue;
+    any = true;
+#if defined(__x86_64__) || defined(__i386__)
+    counters->pages[k] = mmap(NULL, page, PROT_READ, MAP_SHARED,
+                              counters->fds[k], 0);
+    if (MAP_FAILED == counters->pages[k]) counters->pages[k] = NULL;
+#endif
+  }
+  if (!any) {
+    counters_destroy(counters);
+    return NULL;
+  }
+
+  // What a read takes, the least of many so interrupts don't count.
+  for (int k = 0; k < COUNTER_NUM; ++k) counters->overhead[k] = UINT64_MAX;
+  for (int n = 0; n < CALIBRATE_READS; ++n) {
+    counters_read(counters, before);
+    counters_read(counters, after);
+    for (int k = 0; k < COUNTER_NUM; ++k)
+      if (after[k] - before[k] < counters->overhead[k])
+        counters->overhead[k] = after[k] - before[k];
+  }
+  return counters;
+}
+
+void counters_destroy(Counters *counters) {
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  if (!counters) return;
+  for (int k = 0; k < COUNTER_NUM; ++k) {
+    if (counters->pages[k]) munmap(counters->pages[k], page);
+    if (counters->fds[k] >= 0) close(counters->fds[k]);
+  }
+  free(counters);
+}
+
+// Reads a counter from user space, as perf_event_open(2) describes, when the
+// kernel lets rdpmc do it. Returns false if it has to be read().
+static bool read_mapped(const struct perf_event_mmap_page *pc,
+                        uint64_t *value) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t seq, index, low, high;
+  uint64_t count;
+  int64_t pmc;
+
+  do {
+    seq = pc->lock;
+    __sync_synchronize();
+    index = pc->index;
+    if (!pc->cap_user_rdpmc || !index) return false;
+    count = pc->offset;
+    __asm__ volatile("rdpmc" : "=a"(low), "=d"(high) : "c"(index - 1));
+    // Sign extend the pmc_width bits of it.
+    pmc = (int64_t)((uint64_t)high << 32 | low) << (64 - pc->pmc_width);
+    count += pmc >> (64 - pc->pmc_width);
+    __sync_synchronize();
+  } while (pc->lock != seq);
+  *value = count;
+  return true;
+#else
+  return false;
+#endif
+}
+
+void counters_read(Counters *counters, uint64_t values[COUNTER_NUM]) {
+  for (int k = 0; k < COUNTER_NUM; ++k) {
+    values[k] = 0;
+    if (counters->fds[k] < 0) continue;
+    if (counters->pages[k] && read_mapped(counters->pages[k], &values[k]))
+      continue;
+    if (sizeof(uint64_t) != read(counters->fds[k], &values[k], 8))
+      values[k] = 0;
+  }
+}
+
+#else
+
+Counters *counters_create() {
+  return NULL;
+}
+
+void counters_destroy(Counters *counters) {
+}
+
+void counters_read(Counters *counters, uint64_t values[COUNTER_NUM]) {
+  memset(values, 0, COUNTER_NUM * sizeof(uint64_t));
+}
+
+#endif
+
+void counters_start(Counters *counters) {
+  counters->reads = 0;
+  counters_read(counters, counters->start);
+}
+
+// Without what the reads of run_counted() took.
+void counters_stop(Counters *counters, uint64_t steps) {
+  uint64_t now[COUNTER_NUM], delta, reads;
+
+  counters_read(counters, now);
+  for (int k = 0; k < COUNTER_NUM; ++k) {
+    delta = now[k] - counters->start[k];
+    reads = counters->reads * counters->overhead[k];
+    counters->total[k] += delta > reads ? delta - reads : 0;
+  }
+  counters->steps += steps;
+}
+
+void counters_charge(Counters *counters, Opcode opcode,
+                     const uint64_t before[COUNTER_NUM],
+                     const uint64_t after[COUNTER_NUM]) {
+  uint64_t delta;
+
+  for (int k = 0; k < COUNTER_NUM; ++k) {
+    delta = after[k] - before[k];
+    delta = delta > counters->overhead[k] ? delta - counters->overhead[k] : 0;
+    counters->opcodes[opcode][k] += delta;
+  }
+  ++counters->counts[opcode];
+  ++counters->reads;
+}
+
+static void write_values(Counters *counters, FILE *fp, const uint64_t *values,
+                         uint64_t count) {
+  for (int k = 0; k < COUNTER_NUM; ++k) {
+    if (counters->fds[k] < 0)
+      fprintf(fp, " %14s", "-");
+    else
+      fprintf(fp, " %14.2f", count ? (double)values[k] / count : 0);
+  }
+}
+
+void counters_write(VM *vm, FILE *fp) {
+  static const char *engine_names[] = {"call", "threaded", "jit"};
+  Counters *counters = vm->counters;
+
+  if (!counters) return;
+  fprintf(fp, "Engine: %s\n", counters->by_opcode ? "call, per handler" :
+          engine_names[vm->engine]);
+  fprintf(fp, "Instructions run: %llu\n\n",
+          (unsigned long long)counters->steps);
+
+  fprintf(fp, "Host counters per guest instruction:\n%-20s", "");
+#ifdef HAVE_COUNTERS
+  for (int k = 0; k < COUNTER_NUM; ++k)
+    fprintf(fp, " %14s", g_events[k].name);
+#endif
+  fprintf(fp, "\n%-20s", "all");
+  write_values(counters, fp, counters->total, counters->steps);
+  fputc('\n', fp);
+  if (!counters->by_opcode) return;
+
+  fprintf(fp, "\nOpcodes, per instruction with its dispatch:\n%12s %-7s",
+          "count", "opcode");
+#ifdef HAVE_COUNTERS
+  for (int k = 0; k < COUNTER_NUM; ++k)
+    fprintf(fp, " %14s", g_events[k].name);
+#endif
+  fputc('\n', fp);
+  for (int op = 0; op < 32; ++op) {
+    if (!counters->counts[op]) continue;
+    fprintf(fp, "%12llu %-7s", (unsigned long long)counters->counts[op],
+            opcode_name(op));
+    write_values(counters, fp, counters->opcodes[op], counters->counts[op]);
+    fputc('\n', fp);
+  }
+}
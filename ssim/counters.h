@@ -0,0 +1,55 @@
+#ifndef _COUNTERS_H_
+#define _COUNTERS_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+#ifdef __linux__
+#define HAVE_COUNTERS 1
+#endif
+
+// Cycles, instructions, branch misses and cache misses of the host, and the
+// task clock in nanoseconds, for when the hardware ones aren't there.
+#define COUNTER_NUM 5
+
+// Host counters of the runs, see vm_set_counters().
+typedef struct Counters {
+  int fds[COUNTER_NUM];  // -1 for the ones the host doesn't have.
+  void *pages[COUNTER_NUM]; // Mapped to read them with rdpmc, or NULL.
+  uint64_t overhead[COUNTER_NUM]; // What one counters_read() takes.
+
+  uint64_t start[COUNTER_NUM];
+  uint64_t reads;               // By run_counted() since the start.
+  uint64_t total[COUNTER_NUM];  // Of the whole runs.
+  uint64_t steps;
+
+  bool by_opcode;               // Whether run_counted() filled these.
+  uint64_t opcodes[32][COUNTER_NUM];
+  uint64_t counts[32];
+} Counters;
+
+// Returns NULL if the host has no counters, or out of memory.
+Counters *counters_create();
+
+void counters_destroy(Counters *counters);
+
+// Reads the current values.
+void counters_read(Counters *counters, uint64_t values[COUNTER_NUM]);
+
+// Called around every run of an engine, with the steps it ran.
+void counters_start(Counters *counters);
+void counters_stop(Counters *counters, uint64_t steps);
+
+// Charges what was counted from before to after to one instruction of
+// opcode, without what reading the counters took.
+void counters_charge(Counters *counters, Opcode opcode,
+                     const uint64_t before[COUNTER_NUM],
+                     const uint64_t after[COUNTER_NUM]);
+
+// Writes the report of vm, see vm_write_counters().
+void counters_write(VM *vm, FILE *fp);
+
+#endif
@@ -0,0 +1,298 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libssim.h"
+#include "debugger.h"
+
+// One command per line, numbers in decimal:
+//   break PC, delete PC          Sets or clears a breakpoint.
+//   watch INDEX SIZE             Stops before stores to DS[INDEX, INDEX+SIZE).
+//   awatch INDEX SIZE            Stops before loads and stores to them.
+//   unwatch INDEX SIZE           Clears both.
+//   regs                         Replies "ok Z=.. A=.. ... G=.. OF=.. CF=..".
+//   read INDEX SIZE              Replies "ok " and the bytes in hex.
+//   continue                     Runs until something below happens.
+//   interrupt                    Makes continue return early, replies
+//                                nothing of its own.
+//   step [N], reverse-step [N]   Runs N instructions (1) forward or back.
+//   reverse-continue             Goes back to the last breakpoint or
+//                                watchpoint, needs --history.
+//   status                       Reports where it is.
+//   quit
+// Other commands reply "ok" or "error MESSAGE". The ones that run, and
+// status, reply where the program is:
+//   running PC STEPS             It can go on.
+//   break PC STEPS               Before the instruction at PC.
+//   watch PC STEPS INDEX         Before the instruction at PC accesses INDEX.
+//   stopped PC STEPS             It stopped with HLT or RET.
+//   failed PC STEPS MESSAGE      It failed at PC.
+// Breakpoints and watchpoints are stepped over when going on from them.
+
+#define MAX_LINE 256
+#define MAX_READ 4096
+
+// Steps run between checks for a command while continuing.
+#define RUN_SLICE (1 << 22)
+
+typedef struct Debugger {
+  VM *vm;
+  VMStatus status;
+  int in;           // Commands come from here.
+  FILE *out;        // Replies go there.
+  char buf[MAX_LINE];
+  size_t len;       // Bytes read in buf.
+  bool eof;         // The client sent everything it will.
+} Debugger;
+
+// Reads the next line, without its newline, into line. Returns false at the
+// end of the input.
+static bool read_line(Debugger *debugger, char *line) {
+  char *newline;
+  size_t size;
+  ssize_t n;
+
+  for (;;) {
+    newline = memchr(debugger->buf, '\n', debugger->len);
+    if (newline) {
+      size = newline - debugger->buf;
+      memcpy(line, debugger->buf, size);
+      line[size] = '\0';
+      debugger->len -= size + 1;
+      memmove(debugger->buf, newline + 1, debugger->len);
+      return true;
+    }
+    if (debugger->len == MAX_LINE) debugger->len = 0; // Too long, drop it.
+    n = read(debugger->in, debugger->buf + debugger->len,
+             MAX_LINE - debugger->len);
+    if (n < 0 && EINTR == errno) continue;
+    if (n <= 0) {
+      debugger->eof = true;
+      return false;
+    }
+    debugger->len += n;
+  }
+}
+
+// Whether the next command is interrupt, which it drops, or the client went
+// away with nothing left to do.
+static bool interrupted(Debugger *debugger) {
+  struct pollfd fd = {debugger->in, POLLIN, 0};
+  ssize_t n;
+
+  if (!debugger->eof && debugger->len < MAX_LINE && 1 == poll(&fd, 1, 0)) {
+    n = read(debugger->in, debugger->buf + debugger->len,
+             MAX_LINE - debugger->len);
+    if (n > 0) debugger->len += n;
+    if (0 == n) debugger->eof = true;
+  }
+  if (debugger->len >= 10 && !memcmp(debugger->buf, "interrupt\n", 10)) {
+    debugger->len -= 10;
+    memmove(debugger->buf, debugger->buf + 10, debugger->len);
+    return true;
+  }
+  return debugger->eof && !debugger->len;
+}
+
+static void report(Debugger *debugger) {
+  VM *vm = debugger->vm;
+  unsigned long long steps = vm_steps(vm);
+  uint32_t pc = vm_pc(vm);
+  int32_t index;
+
+  switch (debugger->status) {
+    case VM_RUNNING:
+    case VM_WAITING: // IN isn't fed.
+      fprintf(debugger->out, "running %u %llu\n", pc, steps);
+      break;
+    case VM_BREAK:
+      if (vm_watch_hit(vm, &index))
+        fprintf(debugger->out, "watch %u %llu %d\n", pc, steps, index);
+      else
+        fprintf(debugger->out, "break %u %llu\n", pc, steps);
+      break;
+    case VM_STOPPED:
+      fprintf(debugger->out, "stopped %u %llu\n", pc, steps);
+      break;
+    case VM_ERROR:
+      fprintf(debugger->out, "failed %u %llu %s\n", pc, steps,
+              vm_error(vm) ? vm_error(vm) : "Execution error!");
+      break;
+  }
+}
+
+static void run(Debugger *debugger) {
+  do {
+    debugger->status = vm_run(debugger->vm, RUN_SLICE);
+  } while (VM_RUNNING == debugger->status && !interrupted(debugger));
+}
+
+static void step(Debugger *debugger, unsigned long long n) {
+  debugger->status = VM_RUNNING;
+  while (n-- && VM_RUNNING == debugger->status)
+    debugger->status = vm_step(debugger->vm);
+}
+
+static void print_regs(Debugger *debugger) {
+  static const char *names = "ZABCDEFG";
+  VM *vm = debugger->vm;
+
+  fprintf(debugger->out, "ok");
+  for (int r = 0; r < 8; ++r)
+    fprintf(debugger->out, " %c=%d", names[r], vm_reg(vm, r));
+  fprintf(debugger->out, " OF=%d CF=%d\n", vm_psw(vm) & 1,
+          vm_psw(vm) >> 1 & 1);
+}
+
+static void print_data(Debugger *debugger, int index, unsigned int size) {
+  uint8_t data[MAX_READ];
+
+  if (size > MAX_READ || 0 != vm_read(debugger->vm, index, data, size)) {
+    fprintf(debugger->out, "error Out of data segment\n");
+    return;
+  }
+  fprintf(debugger->out, "ok ");
+  for (unsigned int k = 0; k < size; ++k)
+    fprintf(debugger->out, "%02x", data[k]);
+  putc('\n', debugger->out);
+}
+
+// Runs one command, returns false for quit.
+static bool command(Debugger *debugger, const char *line) {
+  VM *vm = debugger->vm;
+  char name[32];
+  unsigned long long n = 1;
+  unsigned int pc, size;
+  int index, ret;
+
+  if (1 != sscanf(line, "%31s", name)) return true; // Empty line.
+
+  if (!strcmp(name, "break") || !strcmp(name, "delete")) {
+    if (1 != sscanf(line, "%*s %u", &pc) ||
+        0 != vm_set_break(vm, pc, 'b' == name[0])) {
+      fprintf(debugger->out, "error No instruction at PC\n");
+      return true;
+    }
+  } else if (!strcmp(name, "watch") || !strcmp(name, "awatch") ||
+             !strcmp(name, "unwatch")) {
+    if (2 != sscanf(line, "%*s %d %u", &index, &size)) {
+      fprintf(debugger->out, "error Expected INDEX SIZE\n");
+      return true;
+    }
+    if ('u' == name[0])
+      ret = vm_set_watch(vm, index, size, VM_WATCH_WRITE, false) |
+            vm_set_watch(vm, index, size, VM_WATCH_ACCESS, false);
+    else
+      ret = vm_set_watch(vm, index, size, 'a' == name[0] ? VM_WATCH_ACCESS :
+                         VM_WATCH_WRITE, true);
+    if (0 != ret) {
+      fprintf(debugger->out, "error Can't watch that range\n");
+      return true;
+    }
+  } else if (!strcmp(name, "regs")) {
+    print_regs(debugger);
+    return true;
+  } else if (!strcmp(name, "read")) {
+    if (2 != sscanf(line, "%*s %d %u", &index, &size))
+      fprintf(debugger->out, "error Expected INDEX SIZE\n");
+    else
+      print_data(debugger, index, size);
+    return true;
+  } else if (!strcmp(name, "continue")) {
+    run(debugger);
+    report(debugger);
+    return true;
+  } else if (!strcmp(name, "step") || !strcmp(name, "reverse-step")) {
+    sscanf(line, "%*s %llu", &n);
+    if ('s' == name[0])
+      step(debugger, n);
+    else
+      debugger->status = vm_reverse(vm, n);
+    report(debugger);
+    return true;
+  } else if (!strcmp(name, "reverse-continue")) {
+    debugger->status = vm_reverse_continue(vm);
+    report(debugger);
+    return true;
+  } else if (!strcmp(name, "status")) {
+    report(debugger);
+    return true;
+  } else if (!strcmp(name, "interrupt")) {
+    return true; // Came after continue returned.
+  } else if (!strcmp(name, "quit")) {
+    fprintf(debugger->out, "ok\n");
+    return false;
+  } else {
+    fprintf(debugger->out, "error Unknown command\n");
+    return true;
+  }
+  fprintf(debugger->out, "ok\n");
+  return true;
+}
+
+// Waits for one client on the local socket at path.
+static int accept_client(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int server, client;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // One left behind by an earlier run.
+  if (0 == stat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+  server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) return -1;
+  if (0 != bind(server, (struct sockaddr *)&addr, sizeof(addr)) ||
+      0 != listen(server, 1)) {
+    close(server);
+    return -1;
+  }
+  client = accept(server, NULL, NULL);
+  close(server);
+  unlink(path);
+  return client;
+}
+
+int debug_serve(VM *vm, const char *path) {
+  Debugger debugger;
+  char line[MAX_LINE + 1];
+
+  memset(&debugger, 0, sizeof(debugger));
+  debugger.vm = vm;
+  debugger.status = VM_RUNNING;
+  if (!strcmp(path, "-")) {
+    debugger.in = STDIN_FILENO;
+    debugger.out = stderr;
+  } else {
+    debugger.in = accept_client(path);
+    if (debugger.in < 0) return -1;
+    debugger.out = fdopen(debugger.in, "w");
+    if (!debugger.out) {
+      close(debugger.in);
+      return -1;
+    }
+    // A client going away ends the session, not the process.
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  report(&debugger);
+  fflush(debugger.out);
+  while (read_line(&debugger, line) && command(&debugger, line))
+    fflush(debugger.out);
+  fflush(debugger.out);
+  if (stderr != debugger.out) fclose(debugger.out);
+  return 0;
+}
@@ -0,0 +1,12 @@
+#ifndef _DEBUGGER_H_
+#define _DEBUGGER_H_
+
+#include "libssim.h"
+
+// Lets a debugger drive vm with the line protocol described in debugger.c,
+// over the local socket at path, or over stdin and stderr if path is "-".
+// It waits for one client, and returns once it quits or goes away.
+// Returns non-zero if the socket can't be set up.
+int debug_serve(VM *vm, const char *path);
+
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+#include "jit.h"
+#include "guard.h"
+#include "watch.h"
+
+#ifdef HAVE_GUARD_PAGES
+
+#include <setjmp.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// Bytes from the start of DS the instructions can reach: ADDR() + G*2 + 1.
+#define DS_REACH ((size_t)0x1000000 + 0x10000)
+
+// The VM running on this thread, and where to go when it faults.
+static _Thread_local VM *t_vm;
+static _Thread_local sigjmp_buf *t_jmp;
+
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static struct sigaction g_old_action;
+
+static size_t page_up(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  return (size + page - 1) & ~(page - 1);
+}
+
+static void on_fault(int sig, siginfo_t *info, void *context) {
+  VM *vm = t_vm;
+  uint8_t *addr = info->si_addr;
+  const char *msg = NULL;
+  bool watched = false;
+
+  if (vm && t_jmp) {
+    if (addr >= vm->ss_area && addr < vm->ss_area + vm->ss_area_size) {
+      msg = addr < vm->SS ? "Stack underflow!" : "Stack overflow!";
+    } else if (addr >= vm->es_area && addr < vm->es_area + vm->es_area_size) {
+      msg = "Extended-Stack overflow!";
+    } else if (addr >= vm->ds_area && addr < vm->ds_area + vm->ds_area_size) {
+      msg = "Data segment access out of range!";
+      watched = watch_fault(vm, addr);
+    }
+  }
+  if (!msg) {
+    // Not a guest access, crash like we weren't here.
+    sigaction(SIGSEGV, &g_old_action, NULL);
+    return;
+  }
+
+#ifdef HAVE_JIT_ENGINE
+  jit_fault(vm, context);
+#endif
+  if (watched)
+    vm->trap = TRAP_WATCH; // Not an error, see vm_run().
+  else
+    vm->error = msg;
+  siglongjmp(*t_jmp, 1);
+}
+
+static void install_handler() {
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_sigaction = on_fault;
+  // Left with siglongjmp(), so don't keep SIGSEGV blocked.
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, &g_old_action);
+}
+
+// Maps size bytes between two guard pages, and returns the area starting
+// with the first one. The pages only get memory once they are touched, so a
+// stack grows on demand up to size.
+static uint8_t *map_stack(size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  uint8_t *area = mmap(NULL, page + size + page, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (MAP_FAILED == area) return NULL;
+  if (0 != mprotect(area + page, size, PROT_READ | PROT_WRITE)) {
+    munmap(area, page + size + page);
+    return NULL;
+  }
+  return area;
+}
+
+int guard_reserve(VM *vm, uint32_t ds_size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  pthread_once(&g_once, install_handler);
+
+  vm->ds_area_size = DS_GUARD + page_up(ds_size) + page_up(DS_REACH);
+  vm->ds_area = mmap(NULL, vm->ds_area_size, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (MAP_FAILED == vm->ds_area) {
+    vm->ds_area = NULL;
+    goto fail;
+  }
+
+  // SS starts right after a guard page, so popping from an empty stack
+  // faults. Pushing faults once the pages of SS are full, and CALL once the
+  // ones of ES are.
+  vm->ss_size = page_up(vm->ss_size);
+  vm->es_size = page_up(vm->es_size);
+  vm->ss_area_size = page + vm->ss_size + page;
+  vm->es_area_size = page + vm->es_size + page;
+  vm->ss_area = map_stack(vm->ss_size);
+  vm->es_area = map_stack(vm->es_size);
+  if (!vm->ss_area || !vm->es_area) goto fail;
+  vm->SS = vm->ss_area + page;
+  vm->ES = vm->es_area + page;
+  return 0;
+
+fail:
+  guard_release(vm);
+  return -1;
+}
+
+uint8_t *guard_data(VM *vm, uint32_t size) {
+  uint8_t *data = vm->ds_area + DS_GUARD;
+
+  if (0 != mprotect(data, page_up(size), PROT_READ | PROT_WRITE))
+    return NULL;
+  // Ends where the pages do, so the first index past it faults.
+  return data + page_up(size) - size;
+}
+
+void guard_release(VM *vm) {
+  if (vm->ds_area) munmap(vm->ds_area, vm->ds_area_size);
+  if (vm->ss_area) munmap(vm->ss_area, vm->ss_area_size);
+  if (vm->es_area) munmap(vm->es_area, vm->es_area_size);
+  vm->ds_area = vm->ss_area = vm->es_area = NULL;
+  vm->DS = vm->SS = vm->ES = NULL;
+}
+
+int guard_run(VM *vm, int (*run)(VM *vm, uint64_t limit), uint64_t limit) {
+  VM *prev_vm = t_vm;
+  sigjmp_buf *prev_jmp = t_jmp;
+  sigjmp_buf jmp;
+  int ret;
+
+  if (0 == sigsetjmp(jmp, 0)) {
+    t_vm = vm;
+    t_jmp = &jmp;
+    ret = run(vm, limit);
+  } else {
+    ret = -1;
+  }
+  t_vm = prev_vm;
+  t_jmp = prev_jmp;
+  return ret;
+}
+
+#endif
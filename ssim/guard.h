@@ -0,0 +1,35 @@
+#ifndef _GUARD_H_
+#define _GUARD_H_
+
+#include "vm.h"
+
+// Guest memory with guard regions needs mmap() and signals.
+#ifdef __unix__
+#define HAVE_GUARD_PAGES 1
+
+// Offset of DS in its area. Below it is a guard region wide enough for the
+// most negative DS index, -32768 * 2.
+#define DS_GUARD (64 << 10)
+
+// Reserves the DS area and maps SS and ES, all surrounded by inaccessible
+// guard regions. Every DS index the instructions can form lands in the DS
+// area, so accesses outside the data fault instead of hitting other memory.
+// Protection is per page: DS ends on a page boundary, so any index past it
+// faults, but an index below 0 only faults once it's below the page DS starts
+// in. The stack sizes are rounded up to whole pages. Returns non-zero if out
+// of memory.
+int guard_reserve(VM *vm, uint32_t ds_size);
+
+// Makes the pages from DS_GUARD of the DS area that hold size bytes
+// accessible, and returns the last size bytes of them.
+uint8_t *guard_data(VM *vm, uint32_t size);
+
+void guard_release(VM *vm);
+
+// Runs run(vm, limit), turning faults in the guard regions into execution
+// errors, and faults in pages protected for a watch into TRAP_WATCH, with PC
+// pointing at the faulting instruction.
+int guard_run(VM *vm, int (*run)(VM *vm, uint64_t limit), uint64_t limit);
+#endif
+
+#endif
@@ -0,0 +1,357 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+#include "history.h"
+
+// An undo record holds what a step overwrote, written forwards and read
+// backwards from its flags byte, which comes last:
+//   UNDO_MEM   The slot PUSH, CALL, STOREB or STOREW overwrote.
+//   UNDO_TOPS  SS_TOP and ES_TOP, 4 bytes each.
+//   UNDO_PSW   OF | CF << 1.
+//   UNDO_REGS  The registers that changed, then a mask of them.
+//   UNDO_PC    The PC, if the step didn't just go on to the next one.
+#define UNDO_MEM 0x01
+#define UNDO_TOPS 0x02
+#define UNDO_PSW 0x04
+#define UNDO_REGS 0x08
+#define UNDO_PC 0x10
+
+#define MAX_RECORD 64
+
+// Steps between checkpoints to start with.
+#define INITIAL_INTERVAL ((uint64_t)1 << 16)
+
+// Starts every chunk of the undo log.
+typedef struct UndoChunk {
+  uint64_t used;  // Bytes of records.
+} UndoChunk;
+
+History *history_create(VM *vm, size_t size) {
+  History *history = calloc(1, sizeof(History));
+
+  if (!history) return NULL;
+  // Half for the undo log, half for the checkpoints.
+  history->chunk_num = size / 2 / HISTORY_CHUNK_SIZE;
+  if (history->chunk_num < 2) history->chunk_num = 2;
+  // The stacks can be up to a GB, so what they take is counted as
+  // checkpoints are taken, and the count is only capped by DS.
+  history->checkpoint_cap = size / 2 / (sizeof(Checkpoint) + vm->DS_SIZE);
+  if (history->checkpoint_cap < 2) history->checkpoint_cap = 2;
+  if (size / 2 > history->checkpoint_cap * sizeof(Checkpoint))
+    history->checkpoint_budget =
+        size / 2 - history->checkpoint_cap * sizeof(Checkpoint);
+  history->interval = INITIAL_INTERVAL;
+
+  history->chunks = malloc(history->chunk_num * HISTORY_CHUNK_SIZE);
+  history->checkpoints = calloc(history->checkpoint_cap, sizeof(Checkpoint));
+  if (!history->chunks || !history->checkpoints) {
+    history_destroy(history);
+    return NULL;
+  }
+  return history;
+}
+
+void history_destroy(History *history) {
+  if (!history) return;
+  for (size_t k = 0; k < history->checkpoint_num; ++k)
+    free(history->checkpoints[k].data);
+  free(history->checkpoints);
+  free(history->chunks);
+  free(history->inputs);
+  free(history);
+}
+
+static UndoChunk *chunk_at(History *history, size_t k) {
+  return (UndoChunk *)(history->chunks + k * HISTORY_CHUNK_SIZE);
+}
+
+static uint8_t psw_of(VM *vm) {
+  return get_of(vm) | vm->PSW.CF << 1;
+}
+
+static size_t data_size(VM *vm, uint32_t SS_TOP, uint32_t ES_TOP) {
+  return vm->DS_SIZE + SS_TOP + ES_TOP;
+}
+
+static void free_checkpoint(History *history, VM *vm, Checkpoint *checkpoint) {
+  history->checkpoint_bytes -=
+      data_size(vm, checkpoint->SS_TOP, checkpoint->ES_TOP);
+  free(checkpoint->data);
+}
+
+// Keeps the oldest checkpoint and every other one after it.
+static void thin_checkpoints(History *history, VM *vm) {
+  Checkpoint *checkpoints = history->checkpoints;
+  size_t num = 1;
+
+  for (size_t k = 1; k < history->checkpoint_num; ++k) {
+    if (k % 2)
+      free_checkpoint(history, vm, &checkpoints[k]);
+    else
+      checkpoints[num++] = checkpoints[k];
+  }
+  history->checkpoint_num = num;
+  history->interval *= 2;
+}
+
+static int take_checkpoint(History *history, VM *vm) {
+  Checkpoint *checkpoint;
+  size_t size = data_size(vm, vm->SS_TOP, vm->ES_TOP);
+  bool thinned = false;
+  uint8_t *data;
+
+  while (history->checkpoint_num > 1 &&
+         (history->checkpoint_num == history->checkpoint_cap ||
+          history->checkpoint_bytes + size > history->checkpoint_budget)) {
+    thin_checkpoints(history, vm);
+    thinned = true;
+  }
+  if (thinned &&
+      vm->steps < history->checkpoints[history->checkpoint_num - 1].steps +
+                  history->interval)
+    return 0;
+  // Only the oldest one is left and this one doesn't fit next to it, try
+  // again later when the stacks may be smaller.
+  if (history->checkpoint_num &&
+      history->checkpoint_bytes + size > history->checkpoint_budget) {
+    history->interval *= 2;
+    return 0;
+  }
+
+  data = malloc(size);
+  if (!data) return -1;
+  history->checkpoint_bytes += size;
+  memcpy(data, vm->DS, vm->DS_SIZE);
+  memcpy(data + vm->DS_SIZE, vm->SS, vm->SS_TOP);
+  memcpy(data + vm->DS_SIZE + vm->SS_TOP, vm->ES, vm->ES_TOP);
+
+  checkpoint = &history->checkpoints[history->checkpoint_num++];
+  checkpoint->steps = vm->steps;
+  checkpoint->in_pos = history->in_pos;
+  memcpy(checkpoint->general_regs, vm->general_regs, 16);
+  checkpoint->PC = vm->PC;
+  checkpoint->SS_TOP = vm->SS_TOP;
+  checkpoint->ES_TOP = vm->ES_TOP;
+  checkpoint->OF = get_of(vm);
+  checkpoint->CF = vm->PSW.CF;
+  checkpoint->data = data;
+  return 0;
+}
+
+// Where PUSH, CALL, STOREB or STOREW is going to write, and how much.
+static uint8_t *slot_of(VM *vm, const Instr *instr, int *size) {
+  int32_t g = vm->general_regs[7];
+
+  switch (base_opcode(instr->opcode)) {
+    case OP_PUSH:
+      *size = 2;
+      return vm->SS + vm->SS_TOP;
+    case OP_CALL:
+      *size = sizeof(Frame);
+      return vm->ES + vm->ES_TOP;
+    case OP_STOREB:
+      *size = 1;
+      return vm->DS + ((int32_t)instr->addr + g);
+    case OP_STOREW:
+      *size = 2;
+      return vm->DS + ((int32_t)instr->addr + g * 2);
+    default:
+      *size = 0;
+      return NULL;
+  }
+}
+
+int history_before(History *history, VM *vm, const Instr *instr) {
+  Opcode opcode = base_opcode(instr->opcode);
+  uint8_t *slot;
+
+  if (!history->checkpoint_num ||
+      vm->steps >= history->checkpoints[history->checkpoint_num - 1].steps +
+                   history->interval)
+    if (0 != take_checkpoint(history, vm)) return -1;
+
+  history->pc = vm->PC;
+  memcpy(history->regs, vm->general_regs, 16);
+  history->psw = psw_of(vm);
+  history->SS_TOP = vm->SS_TOP;
+  history->ES_TOP = vm->ES_TOP;
+  history->in_before = history->in_pos;
+
+  // Full stacks fail, or fault, without writing.
+  slot = slot_of(vm, instr, &history->slot_size);
+  if ((OP_PUSH == opcode && vm->SS_TOP + 2 > vm->ss_size) ||
+      (OP_CALL == opcode && vm->ES_TOP + sizeof(Frame) > vm->es_size))
+    history->slot_size = 0;
+  if (history->slot_size) memcpy(history->slot, slot, history->slot_size);
+  return 0;
+}
+
+// Logs what IN read for the first time.
+static int log_input(History *history, int16_t value) {
+  int16_t *inputs;
+
+  if (history->in_num == history->in_cap) {
+    size_t cap = history->in_cap ? history->in_cap * 2 : 256;
+
+    inputs = realloc(history->inputs, cap * sizeof(int16_t));
+    if (!inputs) return -1;
+    history->inputs = inputs;
+    history->in_cap = cap;
+  }
+  history->inputs[history->in_num++] = value;
+  history->in_pos = history->in_num;
+  return 0;
+}
+
+// Moves to the next chunk, dropping the oldest one if the ring is full.
+static void next_chunk(History *history) {
+  if (history->live)
+    history->head = (history->head + 1) % history->chunk_num;
+  if (history->live < history->chunk_num) ++history->live;
+  chunk_at(history, history->head)->used = 0;
+}
+
+int history_after(History *history, VM *vm, const Instr *instr) {
+  UndoChunk *chunk = chunk_at(history, history->head);
+  uint8_t flags = 0, mask = 0, *start, *pos;
+
+  if (OP_IN == base_opcode(instr->opcode) &&
+      history->in_pos == history->in_before &&
+      0 != log_input(history, vm->general_regs[instr->reg0]))
+    return -1;
+  if (vm->steps > history->high) history->high = vm->steps;
+
+  if (!history->live ||
+      HISTORY_CHUNK_SIZE - sizeof(UndoChunk) - chunk->used < MAX_RECORD) {
+    next_chunk(history);
+    chunk = chunk_at(history, history->head);
+  }
+  start = pos = (uint8_t *)(chunk + 1) + chunk->used;
+
+  if (history->slot_size) {
+    flags |= UNDO_MEM;
+    memcpy(pos, history->slot, history->slot_size);
+    pos += history->slot_size;
+  }
+  if (history->SS_TOP != vm->SS_TOP || history->ES_TOP != vm->ES_TOP) {
+    flags |= UNDO_TOPS;
+    memcpy(pos, &history->SS_TOP, 4);
+    memcpy(pos + 4, &history->ES_TOP, 4);
+    pos += 8;
+  }
+  if (history->psw != psw_of(vm)) {
+    flags |= UNDO_PSW;
+    *pos++ = history->psw;
+  }
+  for (int r = 0; r < 8; ++r) {
+    if (history->regs[r] == vm->general_regs[r]) continue;
+    mask |= 1 << r;
+    memcpy(pos, &history->regs[r], 2);
+    pos += 2;
+  }
+  if (mask) {
+    flags |= UNDO_REGS;
+    *pos++ = mask;
+  }
+  if (vm->PC != history->pc + 4) {
+    flags |= UNDO_PC;
+    memcpy(pos, &history->pc, 4);
+    pos += 4;
+  }
+  *pos++ = flags;
+
+  chunk->used += pos - start;
+  return 0;
+}
+
+bool history_undo(History *history, VM *vm) {
+  UndoChunk *chunk;
+  uint8_t flags, mask, *start, *pos;
+  const Instr *instr;
+  uint32_t pc;
+  int size;
+
+  while (history->live && !chunk_at(history, history->head)->used) {
+    --history->live;
+    history->head = (history->head + history->chunk_num - 1) %
+                    history->chunk_num;
+  }
+  if (!history->live) return false;
+  chunk = chunk_at(history, history->head);
+  start = (uint8_t *)(chunk + 1);
+  pos = start + chunk->used;
+
+  flags = *--pos;
+  pc = vm->PC - 4;
+  if (flags & UNDO_PC) {
+    pos -= 4;
+    memcpy(&pc, pos, 4);
+  }
+  if (flags & UNDO_REGS) {
+    mask = *--pos;
+    for (int r = 7; r >= 0; --r) {
+      if (!(mask & 1 << r)) continue;
+      pos -= 2;
+      memcpy(&vm->general_regs[r], pos, 2);
+    }
+  }
+  if (flags & UNDO_PSW) {
+    --pos;
+    set_of(vm, *pos & 1);
+    vm->PSW.CF = *pos >> 1 & 1;
+  }
+  if (flags & UNDO_TOPS) {
+    pos -= 8;
+    memcpy(&vm->SS_TOP, pos, 4);
+    memcpy(&vm->ES_TOP, pos + 4, 4);
+  }
+
+  instr = &vm->code[pc / 4];
+  if (flags & UNDO_MEM) {
+    uint8_t *slot = slot_of(vm, instr, &size);
+
+    pos -= size;
+    memcpy(slot, pos, size);
+  }
+  if (OP_IN == base_opcode(instr->opcode)) --history->in_pos;
+
+  chunk->used = pos - start;
+  vm->PC = pc;
+  --vm->steps;
+  vm->stopped = false;
+  return true;
+}
+
+bool history_restore(History *history, VM *vm, uint64_t step) {
+  Checkpoint *checkpoint;
+  size_t k = 0;
+
+  if (!history->checkpoint_num) return false;
+  while (k + 1 < history->checkpoint_num &&
+         history->checkpoints[k + 1].steps <= step)
+    ++k;
+  for (size_t j = k + 1; j < history->checkpoint_num; ++j)
+    free_checkpoint(history, vm, &history->checkpoints[j]);
+  history->checkpoint_num = k + 1;
+  checkpoint = &history->checkpoints[k];
+
+  memcpy(vm->DS, checkpoint->data, vm->DS_SIZE);
+  memcpy(vm->SS, checkpoint->data + vm->DS_SIZE, checkpoint->SS_TOP);
+  memcpy(vm->ES, checkpoint->data + vm->DS_SIZE + checkpoint->SS_TOP,
+         checkpoint->ES_TOP);
+  memcpy(vm->general_regs, checkpoint->general_regs, 16);
+  vm->PC = checkpoint->PC;
+  vm->SS_TOP = checkpoint->SS_TOP;
+  vm->ES_TOP = checkpoint->ES_TOP;
+  set_of(vm, checkpoint->OF);
+  vm->PSW.CF = checkpoint->CF;
+  vm->steps = checkpoint->steps;
+  vm->stopped = false;
+  history->in_pos = checkpoint->in_pos;
+  history->live = 0;
+  return true;
+}
@@ -0,0 +1,86 @@
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "vm.h"
+
+// Bytes of a chunk of the undo log.
+#define HISTORY_CHUNK_SIZE (64 << 10)
+
+// The state of the machine before some step, with a copy of DS, and of SS
+// and ES up to their tops.
+typedef struct Checkpoint {
+  uint64_t steps;
+  size_t in_pos;
+  int16_t general_regs[8];
+  uint32_t PC;
+  uint32_t SS_TOP;
+  uint32_t ES_TOP;
+  uint8_t OF;
+  uint8_t CF;
+  uint8_t *data;
+} Checkpoint;
+
+// What the machine did, so it can go back in time, recorded by
+// run_observed() one instruction at a time.
+// The recent steps can be undone one by one with the undo log. Older ones are
+// reached by restoring the checkpoint before them and running forward again.
+// Both take a bounded amount of memory: the oldest chunk of the undo log is
+// dropped when it's full, and every other checkpoint when they are, taking
+// them twice as far apart from then on.
+// Running forward again must do the same as the first time, so the input
+// read is logged and fed back, and steps that were already run don't write
+// their output again.
+typedef struct History {
+  // The undo log, a ring of chunks.
+  uint8_t *chunks;
+  size_t chunk_num;
+  size_t head;       // The chunk being written.
+  size_t live;       // Chunks holding records.
+
+  Checkpoint *checkpoints; // From the oldest one.
+  size_t checkpoint_num;
+  size_t checkpoint_cap;
+  size_t checkpoint_bytes;  // Held by the copies of DS and the stacks.
+  size_t checkpoint_budget;
+  uint64_t interval;       // Steps between checkpoints.
+
+  int16_t *inputs;   // Every value IN read.
+  size_t in_num;
+  size_t in_cap;
+  size_t in_pos;     // The next one to feed back.
+
+  uint64_t high;     // Steps run so far, any step below is run again.
+
+  // State before the step being recorded.
+  uint32_t pc;
+  int16_t regs[8];
+  uint8_t psw;
+  uint32_t SS_TOP;
+  uint32_t ES_TOP;
+  size_t in_before;
+  uint8_t slot[sizeof(Frame)];  // What PUSH, CALL or STORE* overwrites.
+  int slot_size;
+} History;
+
+// Returns NULL if out of memory.
+History *history_create(VM *vm, size_t size);
+
+void history_destroy(History *history);
+
+// Called around running instr, history_after() once steps and PC moved on.
+// Return non-zero if out of memory.
+int history_before(History *history, VM *vm, const Instr *instr);
+int history_after(History *history, VM *vm, const Instr *instr);
+
+// Undoes the last step. Returns false if it's not in the undo log.
+bool history_undo(History *history, VM *vm);
+
+// Restores the latest checkpoint at or before step, or the oldest one, and
+// drops the ones after it and the undo log. Returns false if it has none.
+bool history_restore(History *history, VM *vm, uint64_t step);
+
+#endif
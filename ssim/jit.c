@@ -0,0 +1,794 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "vm.h"
+#include "jit.h"
+
+#ifdef HAVE_JIT_ENGINE
+
+#include <sys/mman.h>
+#include <ucontext.h>
+
+#define JIT_BUF_SIZE (32 << 20)
+#define JIT_THRESHOLD 16    // Times a block is interpreted before compiling it.
+#define JIT_MAX_BLOCK 128   // Instructions per block.
+#define JIT_MAX_INSTR 192   // Upper bound of native bytes per instruction.
+
+// The state native code works on. Guest registers live in host registers
+// while in native code, and are only stored here on the way out.
+typedef struct JitContext {
+  int32_t regs[8]; // Sign-extended general_regs.
+  uint32_t cf;
+  uint32_t of;
+  uint32_t pc;     // Where native code stopped.
+  uint32_t bailed; // Non-zero if it stopped at an instruction it can't run.
+  uint32_t ss_top;
+  uint32_t es_top;
+  int64_t budget;  // Instructions left to run, checked at block entries.
+  uint8_t *ds;
+  uint8_t *ss;
+  uint8_t *es;
+} JitContext;
+
+// Where the native code of an instruction starts.
+typedef struct JitPc {
+  uint32_t offset;
+  uint32_t pc;
+  uint32_t end; // Index after its block.
+} JitPc;
+
+// A jump to a block that wasn't compiled yet. It goes through the table
+// until the block is compiled, then it's patched into a direct jump.
+typedef struct JitPatch {
+  uint32_t offset; // Of the patchable "mov eax, pc" in the buffer.
+  uint32_t target; // Instruction index.
+} JitPatch;
+
+typedef struct Jit {
+  VM *vm;
+  uint8_t *buf;
+  size_t used;
+
+  void **table;    // Native entry of every instruction index.
+  int32_t *counts; // Hotness of every instruction index, -1 if not compilable.
+
+  JitPatch *patches;
+  size_t patch_num;
+  size_t patch_cap;
+
+  // Sorted by offset, to find the instruction a fault happened in.
+  JitPc *pcs;
+  size_t pc_num;
+  size_t pc_cap;
+
+  // Stubs at the start of the buffer.
+  void (*enter)(JitContext *ctx, void *entry);
+  uint8_t *exit_lookup; // Target pc in eax.
+  uint8_t *exit_bail;   // pc already stored in the context.
+
+  // The block being compiled.
+  uint32_t block_start;
+  uint32_t block_len;
+
+  int64_t budget;  // What native code was entered with.
+
+  JitContext ctx;
+} Jit;
+
+// Host registers.
+enum {
+  RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+  R8, R9, R10, R11, R12, R13, R14, R15,
+};
+
+// Register assignment in native code.
+#define GREG(r) (R8 + (r)) // Guest general_regs[r].
+#define CF_REG RSI
+#define OF_REG RDI
+#define DS_REG RBX
+#define CTX_REG RBP
+
+// Condition codes.
+enum {
+  CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+  CC_S = 0x8, CC_L = 0xc, CC_LE = 0xe, CC_G = 0xf,
+};
+
+// One-byte opcodes of "op r/m32, r32".
+enum {
+  X_ADD = 0x01, X_OR = 0x09, X_AND = 0x21, X_SUB = 0x29, X_XOR = 0x31,
+  X_CMP = 0x39, X_MOVSXD = 0x63, X_TEST = 0x85, X_MOV = 0x89, X_LOAD = 0x8b,
+};
+
+// Extensions of "op r/m32, imm32" (0x81).
+enum { I_ADD = 0, I_AND = 4, I_SUB = 5, I_XOR = 6, I_CMP = 7 };
+
+#define CTX_OFF(field) ((int32_t)offsetof(JitContext, field))
+
+static void emit8(Jit *jit, uint8_t b) {
+  jit->buf[jit->used++] = b;
+}
+
+static void emit32(Jit *jit, uint32_t v) {
+  memcpy(jit->buf + jit->used, &v, 4);
+  jit->used += 4;
+}
+
+static void emit64(Jit *jit, uint64_t v) {
+  memcpy(jit->buf + jit->used, &v, 8);
+  jit->used += 8;
+}
+
+static void emit_rex(Jit *jit, int w, int reg, int index, int base) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1)
+                | (base >> 3);
+  if (rex != 0x40) emit8(jit, rex);
+}
+
+// Emits an opcode of one byte, or two if it starts with 0x0f.
+static void emit_opcode(Jit *jit, int opcode) {
+  if (opcode > 0xff) emit8(jit, opcode >> 8);
+  emit8(jit, opcode & 0xff);
+}
+
+// op reg, rm / op rm, reg, register form.
+static void emit_rr(Jit *jit, int w, int opcode, int reg, int rm) {
+  emit_rex(jit, w, reg, 0, rm);
+  emit_opcode(jit, opcode);
+  emit8(jit, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// op with a memory operand [base + index*2^scale + disp], index < 0 for none.
+// prefix is 0x66 for 16-bit operands, 0 otherwise.
+static void emit_mem(Jit *jit, int prefix, int w, int opcode, int reg,
+                     int base, int index, int scale, int32_t disp) {
+  if (prefix) emit8(jit, prefix);
+  emit_rex(jit, w, reg, index < 0 ? 0 : index, base);
+  emit_opcode(jit, opcode);
+  if (index < 0) {
+    emit8(jit, 0x80 | ((reg & 7) << 3) | (base & 7));
+  } else {
+    emit8(jit, 0x84 | ((reg & 7) << 3));
+    emit8(jit, (scale << 6) | ((index & 7) << 3) | (base & 7));
+  }
+  emit32(jit, disp);
+}
+
+// op r32, imm32.
+static void emit_ri(Jit *jit, int ext, int reg, uint32_t imm) {
+  emit_rex(jit, 0, 0, 0, reg);
+  emit8(jit, 0x81);
+  emit8(jit, 0xc0 | (ext << 3) | (reg & 7));
+  emit32(jit, imm);
+}
+
+static void emit_mov_ri(Jit *jit, int reg, uint32_t imm) {
+  emit_rex(jit, 0, 0, 0, reg);
+  emit8(jit, 0xb8 | (reg & 7));
+  emit32(jit, imm);
+}
+
+static void emit_mov_ri64(Jit *jit, int reg, uint64_t imm) {
+  emit_rex(jit, 1, 0, 0, reg);
+  emit8(jit, 0xb8 | (reg & 7));
+  emit64(jit, imm);
+}
+
+// Loads and stores of the context.
+static void emit_load_ctx(Jit *jit, int w, int reg, int32_t off) {
+  emit_mem(jit, 0, w, X_LOAD, reg, CTX_REG, -1, 0, off);
+}
+
+static void emit_store_ctx(Jit *jit, int reg, int32_t off) {
+  emit_mem(jit, 0, 0, X_MOV, reg, CTX_REG, -1, 0, off);
+}
+
+// setcc al; movzx reg, al.
+static void emit_setcc(Jit *jit, int cc, int reg) {
+  emit8(jit, 0x0f);
+  emit8(jit, 0x90 | cc);
+  emit8(jit, 0xc0);
+  emit_rr(jit, 0, 0x0fb6, reg, RAX);
+}
+
+static void emit_jmp(Jit *jit, uint8_t *target) {
+  emit8(jit, 0xe9);
+  emit32(jit, (uint32_t)(target - (jit->buf + jit->used + 4)));
+}
+
+// Emits a jmp rel32 and returns the offset of rel32, for emit_fix(jit).
+static size_t emit_jmp_fwd(Jit *jit) {
+  emit8(jit, 0xe9);
+  emit32(jit, 0);
+  return jit->used - 4;
+}
+
+// Emits a jcc rel32 and returns the offset of rel32, for emit_fix(jit).
+static size_t emit_jcc(Jit *jit, int cc) {
+  emit8(jit, 0x0f);
+  emit8(jit, 0x80 | cc);
+  emit32(jit, 0);
+  return jit->used - 4;
+}
+
+// Points a forward jump emitted by emit_jcc(jit) or emit_jmp_fwd(jit) at the
+// current position.
+static void emit_fix(Jit *jit, size_t rel) {
+  uint32_t v = jit->used - (rel + 4);
+  memcpy(jit->buf + rel, &v, 4);
+}
+
+// Leaves native code at pc, so the interpreter can run the instruction there.
+// The instructions of the block from pc on weren't run, give them back.
+static void emit_bail(Jit *jit, uint32_t pc) {
+  emit_mem(jit, 0, 1, 0x81, 0, CTX_REG, -1, 0, CTX_OFF(budget));
+  emit32(jit, jit->block_start + jit->block_len - pc / 4);
+  emit_mem(jit, 0, 0, 0xc7, 0, CTX_REG, -1, 0, CTX_OFF(pc));
+  emit32(jit, pc);
+  emit_jmp(jit, jit->exit_bail);
+}
+
+// Bails out at pc if the flags satisfy cc.
+static void emit_bail_if(Jit *jit, int cc, uint32_t pc) {
+  size_t rel = emit_jcc(jit, cc ^ 1);
+  emit_bail(jit, pc);
+  emit_fix(jit, rel);
+}
+
+// Continues at instruction index i, directly if it was compiled, through the
+// table otherwise.
+static void emit_link(Jit *jit, uint32_t i) {
+  JitPatch *patches;
+  size_t cap;
+
+  if (jit->table[i] != jit->exit_lookup) {
+    emit_jmp(jit, jit->table[i]);
+    return;
+  }
+
+  if (jit->patch_num == jit->patch_cap) {
+    cap = jit->patch_cap ? jit->patch_cap * 2 : 64;
+    patches = realloc(jit->patches, cap * sizeof(JitPatch));
+    if (patches) {
+      jit->patches = patches;
+      jit->patch_cap = cap;
+    }
+  }
+  // Without memory for the patch, the jump just keeps going through the table.
+  if (jit->patch_num < jit->patch_cap)
+    jit->patches[jit->patch_num++] = (JitPatch){jit->used, i};
+
+  emit_mov_ri(jit, RAX, i * 4); // Patched into a "jmp rel32" later.
+  emit_mov_ri64(jit, RCX, (uint64_t)(uintptr_t)&jit->table[i]);
+  emit8(jit, 0xff); // jmp [rcx]
+  emit8(jit, 0x21);
+}
+
+// Turns the jumps waiting for instruction index i into direct ones.
+static void patch_links(Jit *jit, uint32_t i) {
+  size_t k = 0;
+  size_t used = jit->used;
+
+  while (k < jit->patch_num) {
+    if (jit->patches[k].target != i) {
+      ++k;
+      continue;
+    }
+    jit->used = jit->patches[k].offset;
+    emit_jmp(jit, jit->table[i]);
+    jit->patches[k] = jit->patches[--jit->patch_num];
+  }
+  jit->used = used;
+}
+
+// rax = ADDR() + G*size, the offset of a DS access. It's signed, so negative
+// offsets hit the guard region below DS.
+static void emit_ds_offset(Jit *jit, const Instr *instr, int size) {
+  emit_rr(jit, 0, X_MOV, GREG(7), RAX);
+  if (2 == size) emit_rr(jit, 0, X_ADD, RAX, RAX);
+  emit_ri(jit, I_ADD, RAX, instr->addr);
+  emit_rr(jit, 1, X_MOVSXD, RAX, RAX);
+}
+
+// Emits r0 = eax with overflow checking, as get_of() works it out.
+static void emit_store_checked(Jit *jit, int r0) {
+  emit_rr(jit, 0, 0x0fbf, RCX, RAX);    // movsx ecx, ax
+  emit_rr(jit, 0, X_CMP, RAX, RCX);
+  emit_setcc(jit, CC_NE, OF_REG);
+  emit_rr(jit, 0, X_MOV, RCX, GREG(r0));
+}
+
+// Returns true if native code has to leave the instruction to the interpreter.
+static bool must_bail(const Instr *instr) {
+  bool uses_reg1 = false, uses_reg2 = false;
+
+  if (do_break == instr->handler) return true;
+  switch (base_opcode(instr->opcode)) {
+    case OP_HLT: case OP_IN: case OP_OUT:
+      return true;
+    case OP_POP: case OP_LOADW: case OP_LOADI: case OP_ADDI: case OP_SUBI:
+      return instr->reg0 == 0;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_AND:
+    case OP_OR: case OP_NOR: case OP_SAL: case OP_SAR:
+      if (instr->reg0 == 0) return true;
+      uses_reg1 = uses_reg2 = true;
+      break;
+    case OP_NOTB:
+      if (instr->reg0 == 0) return true;
+      uses_reg1 = true;
+      break;
+    case OP_EQU: case OP_LT: case OP_LTE:
+      uses_reg1 = true;
+      break;
+    default:
+      break;
+  }
+  // Registers out of range are left to the interpreter.
+  return (uses_reg1 && instr->reg1 > 7) || (uses_reg2 && instr->reg2 > 7);
+}
+
+// Saves general_regs, PC and PSW in a Frame. A full ES faults on the guard
+// page after it.
+static void emit_call(Jit *jit, const Instr *instr, uint32_t pc) {
+  emit_load_ctx(jit, 0, RAX, CTX_OFF(es_top));
+  emit_load_ctx(jit, 1, RCX, CTX_OFF(es));
+  emit_rr(jit, 1, X_ADD, RAX, RCX);
+  for (int k = 0; k < 8; ++k)
+    emit_mem(jit, 0x66, 0, X_MOV, GREG(k), RCX, -1, 0, 2*k);
+  emit_mem(jit, 0, 0, 0xc7, 0, RCX, -1, 0, offsetof(Frame, PC));
+  emit32(jit, pc);
+  emit_rr(jit, 0, X_MOV, CF_REG, RDX);
+  emit_rr(jit, 0, X_ADD, RDX, RDX);
+  emit_rr(jit, 0, X_OR, OF_REG, RDX);
+  emit_mem(jit, 0, 0, X_MOV, RDX, RCX, -1, 0, offsetof(Frame, PSW));
+  emit_ri(jit, I_ADD, RAX, sizeof(Frame));
+  emit_store_ctx(jit, RAX, CTX_OFF(es_top));
+  emit_link(jit, instr->addr / 4);
+}
+
+static void emit_ret(Jit *jit, uint32_t pc) {
+  // The outer most RET is left to the interpreter.
+  emit_load_ctx(jit, 0, RAX, CTX_OFF(es_top));
+  emit_ri(jit, I_CMP, RAX, sizeof(Frame));
+  emit_bail_if(jit, CC_B, pc);
+  emit_ri(jit, I_SUB, RAX, sizeof(Frame));
+  emit_store_ctx(jit, RAX, CTX_OFF(es_top));
+  emit_load_ctx(jit, 1, RCX, CTX_OFF(es));
+  emit_rr(jit, 1, X_ADD, RAX, RCX);
+  for (int k = 0; k < 8; ++k)
+    emit_mem(jit, 0, 0, 0x0fbf, GREG(k), RCX, -1, 0, 2*k);
+  emit_mem(jit, 0, 0, X_LOAD, RDX, RCX, -1, 0, offsetof(Frame, PSW));
+  emit_rr(jit, 0, X_MOV, RDX, OF_REG);
+  emit_ri(jit, I_AND, OF_REG, 1);
+  emit8(jit, 0xd1); // shr edx, 1
+  emit8(jit, 0xea);
+  emit_ri(jit, I_AND, RDX, 1);
+  emit_rr(jit, 0, X_MOV, RDX, CF_REG);
+  // Continue after the CALL, through the table: eax = pc, jmp [table + pc*2].
+  emit_mem(jit, 0, 0, X_LOAD, RAX, RCX, -1, 0, offsetof(Frame, PC));
+  emit_ri(jit, I_ADD, RAX, 4);
+  emit_mov_ri64(jit, RCX, (uint64_t)(uintptr_t)jit->table);
+  emit8(jit, 0xff);
+  emit8(jit, 0x24);
+  emit8(jit, 0x41); // [rcx + rax*2]
+}
+
+// Compiles the instruction at index i, returns true if it ends the block.
+static bool emit_instr(Jit *jit, uint32_t i) {
+  const Instr *instr = &jit->vm->code[i];
+  uint32_t pc = i * 4;
+  int r0 = instr->reg0, r1 = instr->reg1, r2 = instr->reg2;
+  size_t rel;
+
+  if (must_bail(instr)) {
+    emit_bail(jit, pc);
+    return true;
+  }
+
+  switch (base_opcode(instr->opcode)) {
+    case OP_JMP:
+      emit_link(jit, instr->addr / 4);
+      return true;
+    case OP_CJMP:
+    case OP_OJMP:
+      emit_rr(jit, 0, X_TEST, OP_CJMP == base_opcode(instr->opcode) ? CF_REG : OF_REG,
+              OP_CJMP == base_opcode(instr->opcode) ? CF_REG : OF_REG);
+      rel = emit_jcc(jit, CC_E);
+      emit_link(jit, instr->addr / 4);
+      emit_fix(jit, rel);
+      emit_link(jit, i + 1);
+      return true;
+    case OP_CALL:
+      emit_call(jit, instr, pc);
+      return true;
+    case OP_RET:
+      emit_ret(jit, pc);
+      return true;
+    // A full or empty stack faults on the guard pages around SS.
+    case OP_PUSH:
+      emit_load_ctx(jit, 0, RAX, CTX_OFF(ss_top));
+      emit_load_ctx(jit, 1, RCX, CTX_OFF(ss));
+      emit_mem(jit, 0x66, 0, X_MOV, GREG(r0), RCX, RAX, 0, 0);
+      emit_ri(jit, I_ADD, RAX, 2);
+      emit_store_ctx(jit, RAX, CTX_OFF(ss_top));
+      break;
+    case OP_POP:
+      emit_load_ctx(jit, 0, RAX, CTX_OFF(ss_top));
+      emit_ri(jit, I_SUB, RAX, 2);
+      emit_store_ctx(jit, RAX, CTX_OFF(ss_top));
+      emit_rr(jit, 1, X_MOVSXD, RAX, RAX);
+      emit_load_ctx(jit, 1, RCX, CTX_OFF(ss));
+      emit_mem(jit, 0, 0, 0x0fbf, GREG(r0), RCX, RAX, 0, 0);
+      break;
+    case OP_LOADB:
+      emit_ds_offset(jit, instr, 1);
+      emit_mem(jit, 0, 0, 0x0fb6, GREG(r0), DS_REG, RAX, 0, 0);
+      break;
+    case OP_LOADW:
+      emit_ds_offset(jit, instr, 2);
+      emit_mem(jit, 0, 0, 0x0fbf, GREG(r0), DS_REG, RAX, 0, 0);
+      break;
+    case OP_STOREB:
+      emit_ds_offset(jit, instr, 1);
+      emit_mem(jit, 0, 0, 0x88, GREG(r0), DS_REG, RAX, 0, 0);
+      break;
+    case OP_STOREW:
+      emit_ds_offset(jit, instr, 2);
+      emit_mem(jit, 0x66, 0, X_MOV, GREG(r0), DS_REG, RAX, 0, 0);
+      break;
+    case OP_LOADI:
+      emit_mov_ri(jit, GREG(r0), (uint32_t)(int32_t)(int16_t)instr->immediate);
+      break;
+    case OP_NOP:
+      break;
+    case OP_ADD:
+    case OP_SUB:
+      emit_rr(jit, 0, X_MOV, GREG(r1), RAX);
+      emit_rr(jit, 0, OP_ADD == base_opcode(instr->opcode) ? X_ADD : X_SUB, GREG(r2), RAX);
+      emit_store_checked(jit, r0);
+      break;
+    case OP_ADDI:
+    case OP_SUBI:
+      emit_rr(jit, 0, X_MOV, GREG(r0), RAX);
+      emit_ri(jit, OP_ADDI == base_opcode(instr->opcode) ? I_ADD : I_SUB, RAX,
+              instr->immediate);
+      emit_store_checked(jit, r0);
+      break;
+    case OP_MUL:
+      emit_rr(jit, 0, X_MOV, GREG(r1), RAX);
+      emit_rr(jit, 0, 0x0faf, RAX, GREG(r2)); // imul eax, r2
+      emit_store_checked(jit, r0);
+      break;
+    case OP_DIV:
+      emit_rr(jit, 0, X_TEST, GREG(r2), GREG(r2));
+      emit_bail_if(jit, CC_E, pc);
+      emit_rr(jit, 0, X_MOV, GREG(r1), RAX);
+      emit8(jit, 0x99); // cdq
+      emit_rr(jit, 0, 0xf7, 7, GREG(r2)); // idiv r2
+      emit_store_checked(jit, r0);
+      break;
+    case OP_AND:
+    case OP_OR:
+    case OP_NOR:
+      // Bitwise operations keep the values sign-extended.
+      emit_rr(jit, 0, X_MOV, GREG(r1), RAX);
+      emit_rr(jit, 0, OP_AND == base_opcode(instr->opcode) ? X_AND :
+              OP_OR == base_opcode(instr->opcode) ? X_OR : X_XOR, GREG(r2), RAX);
+      emit_rr(jit, 0, X_MOV, RAX, GREG(r0));
+      break;
+    case OP_NOTB:
+      emit_rr(jit, 0, X_MOV, GREG(r1), RAX);
+      emit_rr(jit, 0, 0xf7, 2, RAX); // not eax
+      emit_rr(jit, 0, X_MOV, RAX, GREG(r0));
+      break;
+    case OP_SAL:
+      emit_rr(jit, 0, X_MOV, GREG(r1), RAX);
+      emit_rr(jit, 0, X_MOV, GREG(r2), RCX);
+      emit_rr(jit, 0, 0xd3, 4, RAX); // shl eax, cl
+      emit_rr(jit, 0, 0x0fbf, GREG(r0), RAX);
+      break;
+    case OP_SAR:
+      // do_sar() shifts at most 16 times, 15 is as good for 16-bit values.
+      emit_rr(jit, 0, X_MOV, GREG(r2), RCX);
+      emit_rr(jit, 0, X_XOR, RDX, RDX);
+      emit_rr(jit, 0, X_TEST, RCX, RCX);
+      emit_rr(jit, 0, 0x0f40 | CC_S, RCX, RDX); // cmovs ecx, edx
+      emit_mov_ri(jit, RDX, 15);
+      emit_rr(jit, 0, X_CMP, RDX, RCX);
+      emit_rr(jit, 0, 0x0f40 | CC_G, RCX, RDX); // cmovg ecx, edx
+      emit_rr(jit, 0, X_MOV, GREG(r1), RAX);
+      emit_rr(jit, 0, 0xd3, 7, RAX); // sar eax, cl
+      emit_rr(jit, 0, X_MOV, RAX, GREG(r0));
+      break;
+    case OP_EQU:
+    case OP_LT:
+    case OP_LTE:
+      emit_rr(jit, 0, X_CMP, GREG(r1), GREG(r0));
+      emit_setcc(jit, OP_EQU == base_opcode(instr->opcode) ? CC_E :
+                 OP_LT == base_opcode(instr->opcode) ? CC_L : CC_LE, CF_REG);
+      break;
+    case OP_NOTC:
+      emit_ri(jit, I_XOR, CF_REG, 1);
+      break;
+    default:
+      emit_bail(jit, pc);
+      return true;
+  }
+  return false;
+}
+
+// Returns true if native code of a block stops after the instruction.
+static bool ends_block(const Instr *instr) {
+  switch (base_opcode(instr->opcode)) {
+    case OP_JMP: case OP_CJMP: case OP_OJMP: case OP_CALL: case OP_RET:
+      return true;
+    default:
+      return must_bail(instr);
+  }
+}
+
+// Compiles the block starting at instruction index start.
+// Returns non-zero if it can't be compiled.
+static int compile_block(Jit *jit, uint32_t start) {
+  const Instr *code = jit->vm->code;
+  uint32_t n = jit->vm->CS_SIZE / 4;
+  uint8_t *entry;
+  uint32_t i, len;
+  size_t rel, first = jit->pc_num;
+
+  if (start >= n || must_bail(&code[start])) return -1;
+  if (jit->used + (JIT_MAX_BLOCK + 2) * JIT_MAX_INSTR > JIT_BUF_SIZE)
+    return -1;
+  if (jit->pc_num + JIT_MAX_BLOCK + 1 > jit->pc_cap) {
+    size_t cap = jit->pc_cap ? jit->pc_cap * 2 : 1024;
+    JitPc *pcs = realloc(jit->pcs, cap * sizeof(JitPc));
+
+    if (!pcs) return -1;
+    jit->pcs = pcs;
+    jit->pc_cap = cap;
+  }
+
+  // The number of instructions the block runs, unless it bails.
+  for (len = 0; start + len < n && len < JIT_MAX_BLOCK; )
+    if (ends_block(&code[start + len++])) break;
+  jit->block_start = start;
+  jit->block_len = len;
+
+  // Leaves at the entry once the budget is used up, then charges the block.
+  entry = jit->buf + jit->used;
+  jit->pcs[jit->pc_num++] = (JitPc){jit->used, start * 4, 0};
+  emit_mem(jit, 0, 1, 0x81, I_CMP, CTX_REG, -1, 0, CTX_OFF(budget));
+  emit32(jit, 0);
+  rel = emit_jcc(jit, CC_G);
+  emit_mov_ri(jit, RAX, start * 4);
+  emit_jmp(jit, jit->exit_lookup);
+  emit_fix(jit, rel);
+  emit_mem(jit, 0, 1, 0x81, I_SUB, CTX_REG, -1, 0, CTX_OFF(budget));
+  emit32(jit, len);
+
+  for (i = start; ; ++i) {
+    if (i == n || i - start == JIT_MAX_BLOCK) {
+      emit_link(jit, i);
+      break;
+    }
+    jit->pcs[jit->pc_num++] = (JitPc){jit->used, i * 4, 0};
+    if (emit_instr(jit, i)) break;
+  }
+  for (size_t k = first; k < jit->pc_num; ++k)
+    jit->pcs[k].end = start + len;
+
+  jit->table[start] = entry;
+  patch_links(jit, start);
+  return 0;
+}
+
+// Emits the stubs for entering and leaving native code.
+static void emit_stubs(Jit *jit) {
+  static const int saved[] = {RBX, RBP, R12, R13, R14, R15};
+  size_t rel;
+
+  // void enter(JitContext *ctx, void *entry)
+  jit->enter = (void (*)(JitContext *, void *))(jit->buf + jit->used);
+  for (int k = 0; k < 6; ++k) {
+    emit_rex(jit, 0, 0, 0, saved[k]);
+    emit8(jit, 0x50 | (saved[k] & 7));
+  }
+  emit_rr(jit, 1, X_MOV, RDI, CTX_REG);
+  emit_rr(jit, 1, X_MOV, RSI, RAX);
+  for (int k = 0; k < 8; ++k)
+    emit_load_ctx(jit, 0, GREG(k), CTX_OFF(regs) + 4*k);
+  emit_load_ctx(jit, 0, CF_REG, CTX_OFF(cf));
+  emit_load_ctx(jit, 0, OF_REG, CTX_OFF(of));
+  emit_load_ctx(jit, 1, DS_REG, CTX_OFF(ds));
+  emit8(jit, 0xff); // jmp rax
+  emit8(jit, 0xe0);
+
+  jit->exit_lookup = jit->buf + jit->used;
+  emit_store_ctx(jit, RAX, CTX_OFF(pc));
+  emit_rr(jit, 0, X_XOR, RAX, RAX);
+  emit_store_ctx(jit, RAX, CTX_OFF(bailed));
+  rel = emit_jmp_fwd(jit);
+
+  jit->exit_bail = jit->buf + jit->used;
+  emit_mem(jit, 0, 0, 0xc7, 0, CTX_REG, -1, 0, CTX_OFF(bailed));
+  emit32(jit, 1);
+
+  emit_fix(jit, rel);
+
+  for (int k = 0; k < 8; ++k)
+    emit_store_ctx(jit, GREG(k), CTX_OFF(regs) + 4*k);
+  emit_store_ctx(jit, CF_REG, CTX_OFF(cf));
+  emit_store_ctx(jit, OF_REG, CTX_OFF(of));
+  for (int k = 5; k >= 0; --k) {
+    emit_rex(jit, 0, 0, 0, saved[k]);
+    emit8(jit, 0x58 | (saved[k] & 7));
+  }
+  emit8(jit, 0xc3);
+}
+
+// Sets up the JIT of vm. Returns non-zero if it can't run here.
+static int jit_init(VM *vm) {
+  uint32_t n = vm->CS_SIZE / 4;
+  Jit *jit;
+
+  jit = vm->jit = calloc(1, sizeof(Jit));
+  if (!jit) goto no_memory;
+  jit->vm = vm;
+  jit->buf = mmap(NULL, JIT_BUF_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == jit->buf) {
+    jit->buf = NULL;
+    goto unsupported;
+  }
+
+  jit->table = malloc((n + 1) * sizeof(void *));
+  jit->counts = calloc(n + 1, sizeof(int32_t));
+  if (!jit->table || !jit->counts) goto no_memory;
+
+  emit_stubs(jit);
+  for (uint32_t i = 0; i <= n; ++i)
+    jit->table[i] = jit->exit_lookup;
+  return 0;
+
+unsupported:
+  vm->error = "JIT not supported on this machine!";
+  jit_destroy(vm);
+  return -1;
+no_memory:
+  vm->error = "Out of memory!";
+  jit_destroy(vm);
+  return -1;
+}
+
+void jit_destroy(VM *vm) {
+  Jit *jit = vm->jit;
+
+  if (!jit) return;
+  if (jit->buf) munmap(jit->buf, JIT_BUF_SIZE);
+  free(jit->table);
+  free(jit->counts);
+  free(jit->patches);
+  free(jit->pcs);
+  free(jit);
+  vm->jit = NULL;
+}
+
+bool jit_fault(VM *vm, const void *context) {
+  const greg_t *gregs = ((const ucontext_t *)context)->uc_mcontext.gregs;
+  const void *ip = (const void *)gregs[REG_RIP];
+  Jit *jit = vm->jit;
+  size_t lo = 0, hi, mid, offset;
+  const JitPc *at;
+
+  if (!jit || !jit->buf || (const uint8_t *)ip < jit->buf ||
+      (const uint8_t *)ip >= jit->buf + jit->used)
+    return false;
+
+  // The last instruction starting at or before ip.
+  offset = (const uint8_t *)ip - jit->buf;
+  hi = jit->pc_num;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (jit->pcs[mid].offset <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (0 == lo) return false;
+  at = &jit->pcs[lo - 1];
+
+  // Guest registers are in host registers, the rest in the context.
+  for (int k = 0; k < 8; ++k)
+    vm->general_regs[k] = gregs[REG_R8 + k];
+  vm->PSW.CF = gregs[REG_RSI] & 1;
+  set_of(vm, gregs[REG_RDI] & 1);
+  vm->SS_TOP = jit->ctx.ss_top;
+  vm->ES_TOP = jit->ctx.es_top;
+  vm->PC = at->pc;
+  // The block was charged in full, the instructions from pc on didn't run.
+  vm->steps += jit->budget - jit->ctx.budget - (at->end - at->pc / 4);
+  return true;
+}
+
+// Runs native code from instruction index i until it leaves, or about budget
+// instructions were run.
+static void run_native(Jit *jit, uint32_t i, int64_t budget) {
+  VM *vm = jit->vm;
+  JitContext *ctx = &jit->ctx;
+
+  for (int k = 0; k < 8; ++k)
+    ctx->regs[k] = vm->general_regs[k];
+  ctx->cf = vm->PSW.CF;
+  ctx->of = get_of(vm);
+  ctx->ss_top = vm->SS_TOP;
+  ctx->es_top = vm->ES_TOP;
+  ctx->budget = jit->budget = budget;
+  ctx->ds = vm->DS;
+  ctx->ss = vm->SS;
+  ctx->es = vm->ES;
+
+  jit->enter(ctx, jit->table[i]);
+
+  for (int k = 0; k < 8; ++k)
+    vm->general_regs[k] = ctx->regs[k];
+  vm->PSW.CF = ctx->cf;
+  set_of(vm, ctx->of);
+  vm->SS_TOP = ctx->ss_top;
+  vm->ES_TOP = ctx->es_top;
+  vm->PC = ctx->pc;
+  vm->steps += budget - ctx->budget;
+}
+
+// Interprets one instruction.
+static int run_one(VM *vm) {
+  const Instr *instr = &vm->code[vm->PC / 4];
+
+  if (0 != instr->handler(vm, instr)) return -1;
+  vm->steps += instr_length(instr->opcode);
+  if (!vm->stopped) vm->PC += 4;
+  return 0;
+}
+
+// Interprets instructions until the end of a basic block.
+static int run_block(VM *vm) {
+  Opcode opcode;
+
+  do {
+    opcode = vm->code[vm->PC / 4].opcode;
+    if (0 != run_one(vm)) return -1;
+  } while (!vm->stopped && !is_block_end(opcode));
+  return 0;
+}
+
+int run_jit(VM *vm, uint64_t limit) {
+  Jit *jit;
+  uint32_t i;
+  uint64_t left;
+
+  if (!vm->jit && 0 != jit_init(vm)) return -1;
+  jit = vm->jit;
+
+  while (!vm->stopped && vm->steps < limit) {
+    i = vm->PC / 4;
+    if (jit->table[i] != jit->exit_lookup) {
+      left = limit - vm->steps;
+      run_native(jit, i, left > INT64_MAX ? INT64_MAX : (int64_t)left);
+      if (jit->ctx.bailed && 0 != run_one(vm)) return -1;
+      continue;
+    }
+
+    if (jit->counts[i] >= 0 && ++jit->counts[i] >= JIT_THRESHOLD) {
+      if (0 == compile_block(jit, i)) continue;
+      jit->counts[i] = -1; // Don't try again.
+    }
+    if (0 != run_block(vm)) return -1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _JIT_H_
+#define _JIT_H_
+
+#include "vm.h"
+
+// The JIT needs x86-64 and mmap().
+#if defined(__x86_64__) && defined(__unix__)
+#define HAVE_JIT_ENGINE 1
+
+// Runs the program until it stops or at least limit instructions were run,
+// compiling hot basic blocks to native code.
+// Returns non-zero on execution error, with PC pointing at the failed instruction.
+int run_jit(VM *vm, uint64_t limit);
+
+// Releases the native code of vm.
+void jit_destroy(VM *vm);
+
+// If the fault with the signal context happened in native code, stores the
+// state native code had into vm, with PC at the faulting instruction.
+// Returns false if it didn't.
+bool jit_fault(VM *vm, const void *context);
+#endif
+
+#endif
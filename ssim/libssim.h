@@ -0,0 +1,207 @@
+#ifndef _LIBSSIM_H_
+#define _LIBSSIM_H_
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// An embeddable simulator. Every VM is independent of the others, so one
+// process can run as many guests as it likes, one thread per VM at a time.
+typedef struct VM VM;
+
+// Ways of running the decoded program.
+typedef enum VMEngine {
+  VM_ENGINE_CALL,     // Calls through the handler of each instruction.
+  VM_ENGINE_THREADED, // Direct-threaded code.
+  VM_ENGINE_JIT,      // Native code for hot basic blocks.
+} VMEngine;
+
+typedef enum VMStatus {
+  VM_RUNNING, // Ran out of steps, can be run further.
+  VM_STOPPED, // HLT or the outer most RET.
+  VM_ERROR,   // See vm_error() and vm_pc().
+  VM_BREAK,   // At a breakpoint or watchpoint, see vm_set_break().
+  VM_WAITING, // At an IN with nothing to read, see vm_set_feed().
+} VMStatus;
+
+// Accesses a watchpoint stops at.
+typedef enum VMWatch {
+  VM_WATCH_WRITE,  // Stores.
+  VM_WATCH_ACCESS, // Loads and stores.
+} VMWatch;
+
+// Creates a VM, returns NULL if out of memory.
+// It reads from stdin and writes to stdout, with the call engine and
+// superinstructions on.
+VM *vm_create();
+
+// Sets the engine, returns non-zero if this build doesn't support it.
+int vm_set_engine(VM *vm, VMEngine engine);
+
+// Turns superinstructions on or off, before vm_load().
+void vm_set_fuse(VM *vm, bool fuse);
+
+// Sets how far SS and ES can grow in bytes, before vm_load(), 0 keeps the
+// size, 1 MB each by default. Where guard pages are supported, they are
+// rounded up to whole pages and only take memory as the stacks grow.
+// Returns non-zero if a size is over 1 GB.
+int vm_set_stack_sizes(VM *vm, size_t ss_size, size_t es_size);
+
+// Sets the streams used by IN and OUT.
+void vm_set_io(VM *vm, FILE *in, FILE *out);
+
+// Makes IN read what vm_feed() gives it instead of the input stream, after
+// vm_load(). IN with nothing to read stops the run with VM_WAITING right
+// before it, and it's run again by the next vm_run() or vm_step(), so many
+// interactive VMs can share a thread.
+void vm_set_feed(VM *vm, bool on);
+
+// Gives IN size more bytes to read, or the end of the input if size is 0,
+// after which IN reads -1. Returns non-zero if out of memory.
+int vm_feed(VM *vm, const void *buf, size_t size);
+
+// Output of OUT is buffered, and written when IN needs input, when the
+// program stops, and at least every ms milliseconds while it runs (100 by
+// default). 0 writes every character right away, negative only on IN and stop.
+void vm_set_flush_interval(VM *vm, int ms);
+
+// Turns profiling on or off. While it's on, vm_run() counts how many times
+// every instruction and opcode runs, how many times every branch jumps, and
+// every CALL target. It runs the instructions one by one, whatever the engine.
+void vm_set_profile(VM *vm, bool on);
+
+// Turns reading the host's hardware counters around the runs on or off,
+// where Linux perf_event_open() gives them: cycles, instructions, branch
+// misses, cache misses, and the task clock. With the call engine, the
+// instructions are run one by one through their handlers, and the counters
+// read after every one of them are charged to its opcode. The other engines
+// run as they are, and only get totals, to compare how they dispatch.
+void vm_set_counters(VM *vm, bool on);
+
+// Records an execution trace in a ring buffer of about size bytes, 0 turns it
+// off. Every instruction run records its PC, the registers it changed, the DS
+// index and value it loaded or stored, and the new PSW if it changed, so the
+// buffer holds the last few million steps. Like profiling, it runs the
+// instructions one by one.
+void vm_set_trace(VM *vm, size_t size);
+
+// Keeps about size bytes of history, so vm_reverse() can go back in time, 0
+// turns it off. The recent steps are kept in an undo log, older ones are
+// reached from periodic checkpoints, further apart the longer the run. Like
+// profiling, it runs the instructions one by one.
+void vm_set_history(VM *vm, size_t size);
+
+// Loads an image written by sas, or a snapshot written by vm_save(), which
+// resumes where it was saved. Returns non-zero on error, see vm_error().
+int vm_load(VM *vm, const char *file_name);
+
+// Writes a "PC: n problem" line for every instruction the loader couldn't
+// verify: writes to register Z, invalid ports and registers, and jumps out of
+// the code segment. The others run without checking for them, these with
+// the checks, so they only fail if they are run. Returns how many there are.
+int vm_verify(VM *vm, FILE *fp);
+
+// Runs exactly one instruction, even with a breakpoint or watchpoint on it.
+// Returns VM_BREAK if the next one has one.
+VMStatus vm_step(VM *vm);
+
+// Runs until the program stops, or at least steps more instructions were run
+// (0 for no limit). Engines only check the limit at some instructions, so a
+// few more may be run.
+VMStatus vm_run(VM *vm, uint64_t steps);
+
+// Saves the whole state of the machine: registers, PC, PSW, DS, SS and ES,
+// with the program, so vm_load() can resume from it, as many times as needed.
+// Output written so far is flushed, but input read isn't recorded. Returns
+// non-zero if the file can't be written.
+int vm_save(VM *vm, const char *file_name);
+
+// Goes back steps instructions, or as far back as the history goes, see
+// vm_steps(). The input is read again from the history and the output isn't
+// written again when going forward. Going back from an error clears it.
+// Like vm_step(), it returns VM_BREAK if it ends up at a breakpoint or
+// watchpoint.
+VMStatus vm_reverse(VM *vm, uint64_t steps);
+
+// Goes back to the last time the instruction at pc was about to run, or as
+// far back as the history goes.
+VMStatus vm_reverse_to(VM *vm, uint32_t pc);
+
+// The message of the last error, NULL if it has none.
+const char *vm_error(VM *vm);
+
+// The PC of the next instruction, or of the one that stopped the program or
+// failed.
+uint32_t vm_pc(VM *vm);
+
+// The number of instructions run so far.
+uint64_t vm_steps(VM *vm);
+
+// Sets or clears a breakpoint on the instruction at pc. vm_run() returns
+// VM_BREAK right before running it, and steps over it when run again. It
+// replaces the decoded instruction, so the engines run at full speed until
+// they reach it. Returns non-zero if there's no instruction at pc.
+int vm_set_break(VM *vm, uint32_t pc, bool on);
+
+// Sets or clears a watchpoint on size bytes of DS from index. vm_run()
+// returns VM_BREAK right before an instruction accesses them, see
+// vm_watch_hit(). Their pages are protected while it runs, so the engines run
+// at full speed, only accesses to the same pages slow down. Returns non-zero
+// if the range is outside DS, or this build can't protect pages.
+int vm_set_watch(VM *vm, int32_t index, uint32_t size, VMWatch kind, bool on);
+
+// Whether VM_BREAK was returned for a watchpoint, storing the DS index the
+// instruction at PC accesses in *index.
+bool vm_watch_hit(VM *vm, int32_t *index);
+
+// Goes back to the last time a breakpoint or watchpoint would have stopped
+// the program, or as far back as the history goes.
+VMStatus vm_reverse_continue(VM *vm);
+
+// The value of general register r, from 0 for Z to 7 for G.
+int16_t vm_reg(VM *vm, int r);
+
+// The PSW, OF | CF << 1.
+int vm_psw(VM *vm);
+
+// What can be compared between two runs of a program, see vm_get_state().
+typedef struct VMState {
+  int16_t regs[8];
+  uint32_t pc;
+  int psw;             // OF | CF << 1.
+  uint32_t ss_top;     // Bytes on SS and ES.
+  uint32_t es_top;
+  uint64_t ds_hash;    // FNV-1a of DS.
+  uint64_t stack_hash; // Of SS and ES up to their tops.
+} VMState;
+
+// Fills state with the registers, PC, PSW, stack tops, and hashes of DS and
+// the stacks, all 0 if no program is loaded.
+void vm_get_state(VM *vm, VMState *state);
+
+// Copies size bytes of DS from index to buf. Returns non-zero if they are
+// outside DS.
+int vm_read(VM *vm, int32_t index, void *buf, size_t size);
+
+// Writes the profile report, with the source lines from the list file sas
+// wrote (NULL for none).
+void vm_write_profile(VM *vm, FILE *fp, const char *list_file);
+
+// Writes the host counters per guest instruction, and per opcode if they were
+// charged to them.
+void vm_write_counters(VM *vm, FILE *fp);
+
+// Writes the trace to fd, followed by how the run ended up. Returns non-zero
+// on error. It only calls async-signal-safe functions, so it can be called
+// from a signal handler.
+int vm_write_trace(VM *vm, int fd);
+
+// Prints a trace written by vm_write_trace(), one line per step. Returns
+// non-zero if it's not a valid trace.
+int vm_print_trace(FILE *in, FILE *out);
+
+// Releases all the resources.
+void vm_destroy(VM *vm);
+
+#endif
@@ -0,0 +1,303 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "lockstep.h"
+#include "batch.h"
+
+// Steps between comparisons, until they differ. Then the run is done again
+// comparing after every block of the engine.
+#define SYNC_INTERVAL 4096
+
+static const char *g_engine_names[] = {"call", "threaded", "jit"};
+static const char *g_reg_names = "ZABCDEFG";
+
+// One of the two runs, with its output kept in memory.
+typedef struct Side {
+  VM *vm;
+  FILE *in;
+  FILE *out;
+  char *output;
+  size_t output_size;
+  VMStatus status;
+} Side;
+
+typedef struct Lockstep {
+  const LockstepOptions *options;
+  char *input;        // All of stdin.
+  size_t input_size;
+  Side engine;
+  Side reference;
+} Lockstep;
+
+// Reads all of fp. Returns NULL if out of memory.
+static char *read_all(FILE *fp, size_t *size) {
+  char buf[4096], *data = NULL;
+  FILE *out = open_memstream(&data, size);
+  size_t n;
+
+  if (!out) return NULL;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    if (n != fwrite(buf, 1, n, out)) break;
+  fclose(out);
+  return data;
+}
+
+static void stop_side(Side *side) {
+  vm_destroy(side->vm);
+  if (side->in) fclose(side->in);
+  if (side->out) fclose(side->out);
+  free(side->output);
+  memset(side, 0, sizeof(Side));
+}
+
+// Loads the image from the start, with the input from the start. Returns
+// non-zero on error, printing why.
+static int start_side(Lockstep *lockstep, Side *side, VMEngine engine,
+                      bool fuse) {
+  const LockstepOptions *options = lockstep->options;
+
+  stop_side(side);
+  // fmemopen() doesn't take empty buffers everywhere.
+  side->in = lockstep->input_size ?
+             fmemopen(lockstep->input, lockstep->input_size, "rb") :
+             fopen("/dev/null", "rb");
+  side->out = open_memstream(&side->output, &side->output_size);
+  side->vm = vm_create();
+  if (!side->in || !side->out || !side->vm) {
+    printf("Error: Out of memory!\n");
+    return -1;
+  }
+  if (0 != vm_set_engine(side->vm, engine)) {
+    printf("Error: Engine not supported by this build!\n");
+    return -1;
+  }
+  vm_set_fuse(side->vm, fuse);
+  vm_set_stack_sizes(side->vm, options->ss_size, options->es_size);
+  vm_set_io(side->vm, side->in, side->out);
+  vm_set_flush_interval(side->vm, -1); // Flushed at every comparison.
+  if (0 != vm_load(side->vm, options->image)) {
+    printf("Error: %s\n", vm_error(side->vm));
+    return -1;
+  }
+  side->status = VM_RUNNING;
+  return 0;
+}
+
+static int start(Lockstep *lockstep) {
+  const LockstepOptions *options = lockstep->options;
+
+  if (0 != start_side(lockstep, &lockstep->engine, options->engine,
+                      options->fuse))
+    return -1;
+  return start_side(lockstep, &lockstep->reference, options->reference,
+                    false);
+}
+
+// Runs the one behind until both ran as many steps, or ended. The engine
+// may run past a step limit, the reference is stepped instead of it then.
+static void catch_up(Lockstep *lockstep) {
+  Side *engine = &lockstep->engine, *reference = &lockstep->reference;
+  uint64_t e, r;
+
+  for (;;) {
+    e = vm_steps(engine->vm);
+    r = vm_steps(reference->vm);
+    if (r < e && VM_RUNNING == reference->status)
+      reference->status = vm_run(reference->vm, e - r);
+    else if (e < r && VM_RUNNING == engine->status)
+      engine->status = vm_step(engine->vm);
+    else
+      break;
+  }
+  // The instruction that ended one of them isn't a step, try it on the other.
+  if (VM_RUNNING == reference->status && VM_RUNNING != engine->status)
+    reference->status = vm_step(reference->vm);
+  else if (VM_RUNNING == engine->status && VM_RUNNING != reference->status)
+    engine->status = vm_step(engine->vm);
+  fflush(engine->out);
+  fflush(reference->out);
+}
+
+static bool same_error(Side *a, Side *b) {
+  const char *x = vm_error(a->vm), *y = vm_error(b->vm);
+
+  return x == y || (x && y && !strcmp(x, y));
+}
+
+// Whether they are in the same state, with the same output from checked on.
+static bool same(Lockstep *lockstep, size_t checked) {
+  Side *engine = &lockstep->engine, *reference = &lockstep->reference;
+  VMState x, y;
+
+  vm_get_state(engine->vm, &x);
+  vm_get_state(reference->vm, &y);
+  return engine->status == reference->status &&
+         vm_steps(engine->vm) == vm_steps(reference->vm) &&
+         same_error(engine, reference) &&
+         !memcmp(x.regs, y.regs, sizeof(x.regs)) && x.pc == y.pc &&
+         x.psw == y.psw && x.ss_top == y.ss_top && x.es_top == y.es_top &&
+         x.ds_hash == y.ds_hash && x.stack_hash == y.stack_hash &&
+         engine->output_size == reference->output_size &&
+         !memcmp(engine->output + checked, reference->output + checked,
+                 engine->output_size - checked);
+}
+
+static const char *status_name(Side *side) {
+  static const char *names[] = {"running", "stopped", "error", "break",
+                                "waiting"};
+
+  return names[side->status];
+}
+
+// Prints what differs after running from pc at step from, one line each.
+static void report(Lockstep *lockstep, uint32_t pc, uint64_t from) {
+  const LockstepOptions *options = lockstep->options;
+  Side *engine = &lockstep->engine, *reference = &lockstep->reference;
+  const char *x_error = vm_error(engine->vm);
+  const char *y_error = vm_error(reference->vm);
+  size_t k;
+  VMState x, y;
+
+  vm_get_state(engine->vm, &x);
+  vm_get_state(reference->vm, &y);
+  printf("Engines diverged running from PC: %u, after step %llu.\n", pc,
+         (unsigned long long)from);
+  printf("%-8s %12s %12s\n", "", g_engine_names[options->engine],
+         g_engine_names[options->reference]);
+  if (engine->status != reference->status)
+    printf("%-8s %12s %12s\n", "status", status_name(engine),
+           status_name(reference));
+  if (!same_error(engine, reference))
+    printf("%-8s %12s %12s\n", "error", x_error ? x_error : "-",
+           y_error ? y_error : "-");
+  if (vm_steps(engine->vm) != vm_steps(reference->vm))
+    printf("%-8s %12llu %12llu\n", "steps",
+           (unsigned long long)vm_steps(engine->vm),
+           (unsigned long long)vm_steps(reference->vm));
+  if (x.pc != y.pc) printf("%-8s %12u %12u\n", "PC", x.pc, y.pc);
+  for (int r = 0; r < 8; ++r)
+    if (x.regs[r] != y.regs[r])
+      printf("%-8c %12d %12d\n", g_reg_names[r], x.regs[r], y.regs[r]);
+  if (x.psw != y.psw) printf("%-8s %12d %12d\n", "PSW", x.psw, y.psw);
+  if (x.ss_top != y.ss_top)
+    printf("%-8s %12u %12u\n", "SS_TOP", x.ss_top, y.ss_top);
+  if (x.es_top != y.es_top)
+    printf("%-8s %12u %12u\n", "ES_TOP", x.es_top, y.es_top);
+  if (x.ds_hash != y.ds_hash) printf("%-8s %12s\n", "DS", "differs");
+  if (x.stack_hash != y.stack_hash) printf("%-8s %12s\n", "stacks", "differs");
+  for (k = 0; k < engine->output_size && k < reference->output_size; ++k)
+    if (engine->output[k] != reference->output[k]) break;
+  if (k < engine->output_size || k < reference->output_size)
+    printf("%-8s %12s at byte %zu\n", "output", "differs", k);
+}
+
+// Writes the output of the engine from written on.
+static void write_output(Lockstep *lockstep, size_t *written) {
+  Side *engine = &lockstep->engine;
+
+  fwrite(engine->output + *written, 1, engine->output_size - *written,
+         stdout);
+  fflush(stdout);
+  *written = engine->output_size;
+}
+
+// Runs both again from the start, comparing after every block of the engine
+// from step good on, until step until. Reports where they differ and returns
+// true, or returns false if they didn't.
+static bool narrow_down(const Lockstep *lockstep, uint64_t good,
+                        uint64_t until) {
+  Lockstep again = *lockstep;
+  Side *engine = &again.engine;
+  uint64_t from = 0;
+  uint32_t pc = 0;
+  bool found = false;
+
+  memset(&again.engine, 0, sizeof(Side));
+  memset(&again.reference, 0, sizeof(Side));
+  if (0 != start(&again)) goto done;
+  if (good) {
+    engine->status = vm_run(engine->vm, good);
+    catch_up(&again);
+  }
+  while (!(found = !same(&again, 0)) && VM_RUNNING == engine->status &&
+         vm_steps(engine->vm) < until) {
+    from = vm_steps(engine->vm);
+    pc = vm_pc(engine->vm);
+    engine->status = vm_run(engine->vm, 1);
+    catch_up(&again);
+  }
+  if (found) report(&again, pc, from);
+
+done:
+  stop_side(&again.engine);
+  stop_side(&again.reference);
+  return found;
+}
+
+int run_lockstep(const LockstepOptions *options) {
+  Lockstep lockstep;
+  Side *engine = &lockstep.engine;
+  uint64_t good = 0, steps;
+  uint32_t pc;
+  size_t written = 0;
+  int ret = EXIT_FAILURE;
+
+  memset(&lockstep, 0, sizeof(Lockstep));
+  lockstep.options = options;
+  lockstep.input = read_all(stdin, &lockstep.input_size);
+  if (!lockstep.input) {
+    printf("Error: Out of memory!\n");
+    return EXIT_FAILURE;
+  }
+  if (0 != start(&lockstep)) goto done;
+
+  for (;;) {
+    steps = SYNC_INTERVAL;
+    if (options->max_steps && options->max_steps - good < steps)
+      steps = options->max_steps - good;
+    pc = vm_pc(engine->vm);
+    engine->status = vm_run(engine->vm, steps);
+    catch_up(&lockstep);
+    if (!same(&lockstep, written)) {
+      if (!narrow_down(&lockstep, good, vm_steps(engine->vm))) {
+        report(&lockstep, pc, good);
+        printf("They didn't when compared after every block.\n");
+      }
+      goto done;
+    }
+    write_output(&lockstep, &written);
+    good = vm_steps(engine->vm);
+    if (VM_RUNNING != engine->status ||
+        (options->max_steps && good >= options->max_steps))
+      break;
+  }
+
+  // Both ended the same way, report it like a single run.
+  switch (engine->status) {
+    case VM_STOPPED:
+      ret = EXIT_OK;
+      break;
+    case VM_ERROR:
+      if (vm_error(engine->vm)) puts(vm_error(engine->vm));
+      printf("PC: %d\n", vm_pc(engine->vm));
+      printf("Error: Execution error!\n");
+      ret = EXIT_ERROR;
+      break;
+    default:
+      printf("Instruction limit reached after %llu instructions!\n",
+             (unsigned long long)good);
+      printf("PC: %d\n", vm_pc(engine->vm));
+      ret = EXIT_LIMIT;
+      break;
+  }
+
+done:
+  stop_side(&lockstep.engine);
+  stop_side(&lockstep.reference);
+  free(lockstep.input);
+  return ret;
+}
@@ -0,0 +1,26 @@
+#ifndef _LOCKSTEP_H_
+#define _LOCKSTEP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libssim.h"
+
+typedef struct LockstepOptions {
+  const char *image;
+  VMEngine engine;      // The one being verified.
+  VMEngine reference;   // Run without superinstructions.
+  bool fuse;
+  size_t ss_size;       // 0 for the default.
+  size_t es_size;
+  uint64_t max_steps;   // 0 for no limit.
+} LockstepOptions;
+
+// Runs the image with both engines side by side on the same input, read from
+// stdin up front, comparing their states and output as they go, and writes
+// the output to stdout. On the first difference, it finds the first block of
+// the engine where they part and reports what differs there.
+// Returns the exit status of ssim, EXIT_FAILURE if they differ.
+int run_lockstep(const LockstepOptions *options);
+
+#endif
@@ -0,0 +1,201 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+#include "profile.h"
+
+#define HOT_NUM 10 // Instructions in the hottest list.
+
+static const char *g_opcode_names[] = {
+  "HLT", "JMP", "CJMP", "OJMP", "CALL", "RET", "PUSH", "POP",
+  "LOADB", "LOADW", "STOREB", "STOREW", "LOADI", "NOP", "IN", "OUT",
+  "ADD", "ADDI", "SUB", "SUBI", "MUL", "DIV", "AND", "OR",
+  "NOR", "NOTB", "SAL", "SAR", "EQU", "LT", "LTE", "NOTC"};
+
+const char *opcode_name(Opcode opcode) {
+  return g_opcode_names[opcode];
+}
+
+// What list.txt tells about every instruction index.
+typedef struct Listing {
+  char **sources; // The source line, with its label.
+  char **labels;  // The label, if any.
+} Listing;
+
+Profile *profile_create(uint32_t n) {
+  Profile *profile = calloc(1, sizeof(Profile));
+
+  if (!profile) return NULL;
+  profile->counts = calloc(n + 1, sizeof(uint64_t));
+  profile->taken = calloc(n + 1, sizeof(uint64_t));
+  profile->calls = calloc(n + 1, sizeof(uint64_t));
+  if (!profile->counts || !profile->taken || !profile->calls) {
+    profile_destroy(profile);
+    return NULL;
+  }
+  return profile;
+}
+
+void profile_destroy(Profile *profile) {
+  if (!profile) return;
+  free(profile->counts);
+  free(profile->taken);
+  free(profile->calls);
+  free(profile);
+}
+
+// Cuts off the white space at the end of line, returns whether anything is
+// left.
+static bool trim_end(char *line) {
+  size_t len = strlen(line);
+
+  while (len > 0 && strchr(" \t\r\n", line[len - 1])) line[--len] = '\0';
+  return len > 0;
+}
+
+// Reads the source lines and labels from the list file sas writes:
+//   CS: LABEL= pc
+//   source line#PC:pc
+//   0xcode
+// sas cuts off the comment of the source line, and puts #PC:pc in its place.
+// A line without one keeps its line break, so #PC:pc is on a line of its own
+// after it. Missing entries stay NULL.
+static void read_listing(Listing *listing, uint32_t n, const char *list_file) {
+  char *line = NULL, *source = NULL, *label, *mark;
+  size_t len = 0;
+  unsigned int pc;
+  ssize_t size;
+  FILE *fp;
+
+  listing->sources = calloc(n, sizeof(char *));
+  listing->labels = calloc(n, sizeof(char *));
+  if (!list_file || !listing->sources || !listing->labels) return;
+  fp = fopen(list_file, "r");
+  if (!fp) return;
+
+  while (-1 != (size = getline(&line, &len, fp))) {
+    if (size > 0 && '\n' == line[size - 1]) line[size - 1] = '\0';
+
+    if (!strncmp(line, "CS: ", 4)) {
+      label = strrchr(line, '=');
+      if (!label || 1 != sscanf(label + 1, "%u", &pc)) continue;
+      *label = '\0';
+      if (pc % 4 == 0 && pc / 4 < n && !listing->labels[pc / 4])
+        listing->labels[pc / 4] = strdup(line + 4);
+    } else if ((mark = strstr(line, "#PC:")) &&
+               1 == sscanf(mark, "#PC:%u", &pc)) {
+      *mark = '\0';
+      if (trim_end(line)) {
+        free(source);
+        source = strdup(line);
+      }
+      if (pc % 4 == 0 && pc / 4 < n && source && !listing->sources[pc / 4]) {
+        listing->sources[pc / 4] = source;
+        source = NULL;
+      }
+    } else if (strncmp(line, "DS: ", 4) && strncmp(line, "0x", 2)) {
+      free(source);
+      source = trim_end(line) ? strdup(line) : NULL;
+    }
+  }
+
+  free(source);
+  free(line);
+  fclose(fp);
+}
+
+static void destroy_listing(Listing *listing, uint32_t n) {
+  for (uint32_t i = 0; listing->sources && i < n; ++i)
+    free(listing->sources[i]);
+  for (uint32_t i = 0; listing->labels && i < n; ++i)
+    free(listing->labels[i]);
+  free(listing->sources);
+  free(listing->labels);
+}
+
+static double percent(uint64_t count, uint64_t total) {
+  return total ? 100.0 * count / total : 0;
+}
+
+// One row of the per instruction table.
+static void write_row(VM *vm, FILE *fp, Listing *listing, uint64_t total,
+                      uint32_t i) {
+  Profile *profile = vm->profile;
+  Opcode opcode = base_opcode(vm->code[i].opcode);
+  uint64_t count = profile->counts[i];
+  char branch[48] = "";
+
+  if (OP_CJMP == opcode || OP_OJMP == opcode)
+    snprintf(branch, sizeof(branch), "%llu/%llu",
+             (unsigned long long)profile->taken[i],
+             (unsigned long long)(count - profile->taken[i]));
+  fprintf(fp, "%12llu %6.2f%% %21s %7u  %s\n", (unsigned long long)count,
+          percent(count, total), branch, i * 4,
+          listing->sources && listing->sources[i] ? listing->sources[i] :
+          g_opcode_names[opcode]);
+}
+
+void profile_write(VM *vm, FILE *fp, const char *list_file) {
+  Profile *profile = vm->profile;
+  uint32_t n = vm->CS_SIZE / 4;
+  uint32_t hot[HOT_NUM];
+  int hot_num = 0;
+  uint64_t total = 0;
+  Listing listing;
+
+  memset(&listing, 0, sizeof(Listing));
+  if (!profile) return;
+  read_listing(&listing, n, list_file);
+
+  for (int op = 0; op < 32; ++op)
+    total += profile->opcodes[op];
+  fprintf(fp, "Instructions run: %llu\n\n", (unsigned long long)total);
+
+  // Keep the hottest instructions, in order.
+  for (uint32_t i = 0; i < n; ++i) {
+    uint64_t count = profile->counts[i];
+    int k;
+
+    if (!count) continue;
+    if (hot_num == HOT_NUM) {
+      if (count <= profile->counts[hot[HOT_NUM - 1]]) continue;
+      --hot_num; // Drop the coldest.
+    }
+    for (k = hot_num++; k > 0 && profile->counts[hot[k - 1]] < count; --k)
+      hot[k] = hot[k - 1];
+    hot[k] = i;
+  }
+  fprintf(fp, "Hottest instructions:\n");
+  fprintf(fp, "%12s %7s %21s %7s  %s\n", "count", "%", "taken/not taken",
+          "PC", "source");
+  for (int k = 0; k < hot_num; ++k)
+    write_row(vm, fp, &listing, total, hot[k]);
+
+  fprintf(fp, "\nAll instructions:\n");
+  fprintf(fp, "%12s %7s %21s %7s  %s\n", "count", "%", "taken/not taken",
+          "PC", "source");
+  for (uint32_t i = 0; i < n; ++i)
+    write_row(vm, fp, &listing, total, i);
+
+  fprintf(fp, "\nOpcodes:\n");
+  for (int op = 0; op < 32; ++op) {
+    if (!profile->opcodes[op]) continue;
+    fprintf(fp, "%12llu %6.2f%%  %s\n",
+            (unsigned long long)profile->opcodes[op],
+            percent(profile->opcodes[op], total), g_opcode_names[op]);
+  }
+
+  fprintf(fp, "\nCalls:\n");
+  for (uint32_t i = 0; i <= n; ++i) {
+    if (!profile->calls[i]) continue;
+    fprintf(fp, "%12llu %7u  %s\n", (unsigned long long)profile->calls[i],
+            i * 4, i < n && listing.labels && listing.labels[i] ?
+            listing.labels[i] : "");
+  }
+
+  destroy_listing(&listing, n);
+}
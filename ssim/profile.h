@@ -0,0 +1,29 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+// Execution counts, collected by run_profile() one instruction at a time.
+// All the arrays are indexed by instruction index, with room for the sentinel.
+typedef struct Profile {
+  uint64_t *counts;      // Times every instruction ran.
+  uint64_t *taken;       // Times CJMP and OJMP jumped.
+  uint64_t *calls;       // Times CALL jumped to every instruction.
+  uint64_t opcodes[32];  // Times every opcode ran.
+} Profile;
+
+// Returns NULL if out of memory.
+Profile *profile_create(uint32_t n);
+
+void profile_destroy(Profile *profile);
+
+// The mnemonic of a base opcode.
+const char *opcode_name(Opcode opcode);
+
+// Writes the report of vm, see vm_write_profile().
+void profile_write(VM *vm, FILE *fp, const char *list_file);
+
+#endif
@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "scheduler.h"
+
+// Steps a VM runs before the next one gets a turn.
+#define SLICE_STEPS (1 << 16)
+// Output a session can have unsent before its VM waits for the client.
+#define MAX_UNSENT (64 << 10)
+#define MAX_EVENTS 64
+
+typedef struct Session Session;
+
+// A connection and the VM it talks to.
+struct Session {
+  int fd;
+  VM *vm;
+  FILE *out;          // OUT writes to unsent through it.
+  char *unsent;
+  size_t unsent_size;
+  size_t unsent_cap;
+  size_t sent;        // Bytes of unsent the client got.
+  uint32_t events;    // What epoll watches for.
+  bool input_done;    // The client shut its side down.
+  bool waiting;       // For input.
+  bool queued;        // In the run queue.
+  bool ended;         // The program stopped, closed once all is sent.
+  bool gone;          // Freed once it's out of the run queue.
+  Session *next;      // In the run queue.
+  Session *prev_all;  // In the list of all of them.
+  Session *next_all;
+};
+
+typedef struct Scheduler {
+  const SchedulerOptions *options;
+  int epoll;
+  int server;
+  Session *head;      // The run queue.
+  Session *tail;
+  Session *all;
+} Scheduler;
+
+static volatile sig_atomic_t g_quit;
+
+static void on_quit(int sig) {
+  g_quit = 1;
+}
+
+// Listens on the local socket at path, without blocking.
+static int listen_at(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int server;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // One left behind by an earlier run.
+  if (0 == stat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+  server = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (server < 0) return -1;
+  if (0 != bind(server, (struct sockaddr *)&addr, sizeof(addr)) ||
+      0 != listen(server, SOMAXCONN)) {
+    close(server);
+    return -1;
+  }
+  return server;
+}
+
+// The write function of the session's out stream.
+static ssize_t write_unsent(void *cookie, const char *buf, size_t size) {
+  Session *session = cookie;
+  size_t cap = session->unsent_cap ? session->unsent_cap : 4096;
+  char *unsent;
+
+  while (cap < session->unsent_size + size) cap *= 2;
+  if (cap != session->unsent_cap) {
+    unsent = realloc(session->unsent, cap);
+    if (!unsent) return 0;
+    session->unsent = unsent;
+    session->unsent_cap = cap;
+  }
+  memcpy(session->unsent + session->unsent_size, buf, size);
+  session->unsent_size += size;
+  return size;
+}
+
+static void enqueue(Scheduler *scheduler, Session *session) {
+  if (session->queued || session->ended || session->gone) return;
+  session->queued = true;
+  session->next = NULL;
+  if (scheduler->tail)
+    scheduler->tail->next = session;
+  else
+    scheduler->head = session;
+  scheduler->tail = session;
+}
+
+static Session *dequeue(Scheduler *scheduler) {
+  Session *session = scheduler->head;
+
+  scheduler->head = session->next;
+  if (!scheduler->head) scheduler->tail = NULL;
+  session->queued = false;
+  return session;
+}
+
+static void destroy(Scheduler *scheduler, Session *session) {
+  if (session->prev_all)
+    session->prev_all->next_all = session->next_all;
+  else
+    scheduler->all = session->next_all;
+  if (session->next_all) session->next_all->prev_all = session->prev_all;
+  epoll_ctl(scheduler->epoll, EPOLL_CTL_DEL, session->fd, NULL);
+  close(session->fd);
+  vm_destroy(session->vm);
+  if (session->out) fclose(session->out);
+  free(session->unsent);
+  free(session);
+}
+
+// Closes the connection, and frees the session unless the run queue still
+// has it.
+static void drop(Scheduler *scheduler, Session *session) {
+  session->gone = true;
+  if (!session->queued) destroy(scheduler, session);
+}
+
+// Watches for input until the client is done, and for room to send while
+// there's output left.
+static void watch(Scheduler *scheduler, Session *session) {
+  struct epoll_event event;
+
+  event.events = (session->input_done ? 0 : EPOLLIN) |
+                 (session->sent < session->unsent_size ? EPOLLOUT : 0);
+  event.data.ptr = session;
+  if (event.events != session->events)
+    epoll_ctl(scheduler->epoll, EPOLL_CTL_MOD, session->fd, &event);
+  session->events = event.events;
+}
+
+// Sends what the client can take. Returns false if the session was dropped.
+static bool send_unsent(Scheduler *scheduler, Session *session) {
+  ssize_t n;
+
+  while (session->sent < session->unsent_size) {
+    n = send(session->fd, session->unsent + session->sent,
+             session->unsent_size - session->sent, MSG_NOSIGNAL);
+    if (n < 0 && EINTR == errno) continue;
+    if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) break;
+    if (n <= 0) {
+      drop(scheduler, session);
+      return false;
+    }
+    session->sent += n;
+  }
+  if (session->sent == session->unsent_size) {
+    session->sent = session->unsent_size = 0;
+    if (session->ended && session->input_done) {
+      drop(scheduler, session);
+      return false;
+    }
+    // Closing with input unread would reset the connection before the client
+    // read all of the output, so it's read to the end first.
+    if (session->ended && session->vm) {
+      shutdown(session->fd, SHUT_WR);
+      vm_destroy(session->vm);
+      session->vm = NULL;
+    }
+  }
+  watch(scheduler, session);
+  return true;
+}
+
+// Writes how the program ended, like ssim would, and sends the rest.
+static void end(Scheduler *scheduler, Session *session, VMStatus status) {
+  VM *vm = session->vm;
+
+  if (VM_ERROR == status) {
+    if (vm_error(vm)) fprintf(session->out, "%s\n", vm_error(vm));
+    fprintf(session->out, "PC: %d\n", vm_pc(vm));
+    fprintf(session->out, "Error: Execution error!\n");
+  } else if (VM_STOPPED != status) {
+    fprintf(session->out, "Instruction limit reached after %llu "
+            "instructions!\n", (unsigned long long)vm_steps(vm));
+    fprintf(session->out, "PC: %d\n", vm_pc(vm));
+  }
+  fflush(session->out);
+  session->ended = true;
+  send_unsent(scheduler, session);
+}
+
+// Gives the VM what the client sent.
+static void receive(Scheduler *scheduler, Session *session) {
+  char buf[4096];
+  ssize_t n;
+
+  for (;;) {
+    n = read(session->fd, buf, sizeof(buf));
+    if (n < 0 && EINTR == errno) continue;
+    if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno)) break;
+    if (n < 0 || (!session->ended && 0 != vm_feed(session->vm, buf, n))) {
+      drop(scheduler, session);
+      return;
+    }
+    if (!n) {
+      session->input_done = true;
+      break;
+    }
+  }
+  if (session->ended) {
+    if (session->input_done && session->sent == session->unsent_size)
+      drop(scheduler, session);
+    else
+      watch(scheduler, session);
+    return;
+  }
+  session->waiting = false;
+  enqueue(scheduler, session);
+  watch(scheduler, session);
+}
+
+// Runs the session's VM for a slice.
+static void run_slice(Scheduler *scheduler, Session *session) {
+  uint64_t max_steps = scheduler->options->max_steps;
+  uint64_t steps = SLICE_STEPS;
+  VMStatus status = VM_RUNNING;
+
+  if (max_steps && max_steps - vm_steps(session->vm) < steps)
+    steps = max_steps - vm_steps(session->vm);
+  if (steps) status = vm_run(session->vm, steps);
+  fflush(session->out);
+
+  if (VM_WAITING == status) {
+    session->waiting = true;
+  } else if (VM_RUNNING != status ||
+             (max_steps && vm_steps(session->vm) >= max_steps)) {
+    end(scheduler, session, status);
+    return;
+  }
+  if (!send_unsent(scheduler, session)) return;
+  // Left to the client to take some of the output first.
+  if (!session->waiting && session->unsent_size - session->sent <= MAX_UNSENT)
+    enqueue(scheduler, session);
+}
+
+static void accept_sessions(Scheduler *scheduler) {
+  const SchedulerOptions *options = scheduler->options;
+  cookie_io_functions_t io = {NULL, write_unsent, NULL, NULL};
+  struct epoll_event event;
+  Session *session;
+  int fd;
+
+  while ((fd = accept4(scheduler->server, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+    session = calloc(1, sizeof(Session));
+    if (!session) {
+      close(fd);
+      continue;
+    }
+    session->fd = fd;
+    session->next_all = scheduler->all;
+    if (scheduler->all) scheduler->all->prev_all = session;
+    scheduler->all = session;
+    event.events = session->events = EPOLLIN;
+    event.data.ptr = session;
+    session->vm = vm_create();
+    session->out = fopencookie(session, "w", io);
+    if (!session->vm || !session->out ||
+        0 != epoll_ctl(scheduler->epoll, EPOLL_CTL_ADD, fd, &event)) {
+      drop(scheduler, session);
+      continue;
+    }
+
+    vm_set_engine(session->vm, options->engine);
+    vm_set_fuse(session->vm, options->fuse);
+    vm_set_stack_sizes(session->vm, options->ss_size, options->es_size);
+    vm_set_io(session->vm, stdin, session->out);
+    vm_set_flush_interval(session->vm, -1); // Sent after every slice.
+    vm_set_feed(session->vm, true);
+    if (0 != vm_load(session->vm, options->image)) {
+      fprintf(session->out, "Error: %s\n", vm_error(session->vm));
+      fflush(session->out);
+      session->ended = true;
+      send_unsent(scheduler, session);
+      continue;
+    }
+    enqueue(scheduler, session);
+  }
+}
+
+static void on_event(Scheduler *scheduler, Session *session, uint32_t events) {
+  if (events & EPOLLERR) {
+    drop(scheduler, session);
+    return;
+  }
+  if ((events & EPOLLOUT) && !send_unsent(scheduler, session)) return;
+  if (events & EPOLLIN) {
+    receive(scheduler, session);
+  } else if (events & EPOLLHUP) {
+    // Gone for good, nobody reads the output.
+    drop(scheduler, session);
+    return;
+  }
+  if (session->gone) return;
+  // Took enough of the output to go on.
+  if (!session->waiting && session->unsent_size - session->sent <= MAX_UNSENT)
+    enqueue(scheduler, session);
+}
+
+int run_scheduler(const SchedulerOptions *options) {
+  struct epoll_event events[MAX_EVENTS], event;
+  struct sigaction action;
+  Scheduler scheduler;
+  int n;
+
+  memset(&scheduler, 0, sizeof(Scheduler));
+  scheduler.options = options;
+  scheduler.server = listen_at(options->path);
+  if (scheduler.server < 0) return -1;
+  scheduler.epoll = epoll_create1(EPOLL_CLOEXEC);
+  event.events = EPOLLIN;
+  event.data.ptr = NULL; // The server.
+  if (scheduler.epoll < 0 ||
+      0 != epoll_ctl(scheduler.epoll, EPOLL_CTL_ADD, scheduler.server,
+                     &event)) {
+    if (scheduler.epoll >= 0) close(scheduler.epoll);
+    close(scheduler.server);
+    unlink(options->path);
+    return -1;
+  }
+
+  // Not restarted, so epoll_wait() returns on them.
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_quit;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  while (!g_quit) {
+    // Only wait when no VM can run.
+    n = epoll_wait(scheduler.epoll, events, MAX_EVENTS,
+                   scheduler.head ? 0 : -1);
+    for (int k = 0; k < n; ++k) {
+      if (!events[k].data.ptr)
+        accept_sessions(&scheduler);
+      else
+        on_event(&scheduler, events[k].data.ptr, events[k].events);
+    }
+
+    // A slice for every VM that was ready, in turn.
+    for (Session *last = scheduler.tail, *session = NULL;
+         scheduler.head && session != last;) {
+      session = dequeue(&scheduler);
+      if (session->gone)
+        destroy(&scheduler, session);
+      else
+        run_slice(&scheduler, session);
+    }
+  }
+
+  while (scheduler.all) destroy(&scheduler, scheduler.all);
+  close(scheduler.epoll);
+  close(scheduler.server);
+  unlink(options->path);
+  return 0;
+}
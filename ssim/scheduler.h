@@ -0,0 +1,27 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libssim.h"
+
+typedef struct SchedulerOptions {
+  const char *image;
+  const char *path;     // Of the local socket.
+  VMEngine engine;
+  bool fuse;
+  size_t ss_size;       // 0 for the default.
+  size_t es_size;
+  uint64_t max_steps;   // Per session, 0 for no limit.
+} SchedulerOptions;
+
+// Runs a VM of the image for every connection to the local socket, all of
+// them on this thread, taking turns in time slices. The connection is the
+// stdin and stdout of its program, a VM waiting for input is set aside until
+// some arrives. Once the program stops, what ssim would print about how it
+// ended is written, and the connection is closed. Runs until SIGINT or
+// SIGTERM. Returns non-zero if the socket can't be set up.
+int run_scheduler(const SchedulerOptions *options);
+
+#endif
@@ -0,0 +1,137 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "libssim.h"
+#include "server.h"
+#include "batch.h"
+
+// A client connects and writes the input of the run, which IN reads as it
+// comes, and shuts its side down for writing when there's no more. Once the
+// program stops, the server replies with a line
+//   EXIT STEPS SIZE
+// the exit status ssim would have, the instructions run, and the bytes of
+// output after the line: what the program wrote, followed by the error or
+// limit ssim would report. Then it closes the connection.
+
+static volatile sig_atomic_t g_quit;
+
+static void on_quit(int sig) {
+  g_quit = 1;
+}
+
+// Listens on the local socket at path.
+static int listen_at(const char *path) {
+  struct sockaddr_un addr;
+  struct stat st;
+  int server;
+
+  if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  // One left behind by an earlier run.
+  if (0 == stat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path);
+  server = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (server < 0) return -1;
+  if (0 != bind(server, (struct sockaddr *)&addr, sizeof(addr)) ||
+      0 != listen(server, SOMAXCONN)) {
+    close(server);
+    return -1;
+  }
+  return server;
+}
+
+static int write_all(int fd, const char *buf, size_t size) {
+  ssize_t n;
+
+  while (size) {
+    n = write(fd, buf, size);
+    if (n < 0 && EINTR == errno) continue;
+    if (n <= 0) return -1;
+    buf += n;
+    size -= n;
+  }
+  return 0;
+}
+
+// Runs the program in a forked child, on the connection client.
+static void run_child(VM *vm, int client, uint64_t max_steps) {
+  char *output = NULL, header[64];
+  size_t size = 0;
+  FILE *in = fdopen(client, "rb");
+  FILE *out = open_memstream(&output, &size);
+  int status = EXIT_ERROR, len;
+
+  if (!in || !out) return;
+  vm_set_io(vm, in, out);
+  vm_set_flush_interval(vm, -1); // Sent all at once.
+  switch (vm_run(vm, max_steps)) {
+    case VM_STOPPED:
+      status = EXIT_OK;
+      break;
+    case VM_ERROR:
+      if (vm_error(vm)) fprintf(out, "%s\n", vm_error(vm));
+      fprintf(out, "PC: %d\n", vm_pc(vm));
+      fprintf(out, "Error: Execution error!\n");
+      break;
+    default:
+      fprintf(out, "Instruction limit reached after %llu instructions!\n",
+              (unsigned long long)vm_steps(vm));
+      fprintf(out, "PC: %d\n", vm_pc(vm));
+      status = EXIT_LIMIT;
+      break;
+  }
+  fflush(out);
+
+  len = snprintf(header, sizeof(header), "%d %llu %zu\n", status,
+                 (unsigned long long)vm_steps(vm), size);
+  if (0 == write_all(client, header, len)) write_all(client, output, size);
+}
+
+int serve(VM *vm, const char *path, uint64_t max_steps) {
+  struct sigaction action;
+  int server, client;
+  pid_t pid;
+
+  server = listen_at(path);
+  if (server < 0) return -1;
+
+  // Children are reaped by the kernel, clients going away only end theirs.
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+  // Not restarted, so accept() returns on them.
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = on_quit;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+
+  fflush(NULL); // Or the children would write it again.
+  while (!g_quit) {
+    client = accept(server, NULL, NULL);
+    if (client < 0) continue;
+    pid = fork();
+    if (!pid) {
+      close(server);
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      run_child(vm, client, max_steps);
+      _exit(0);
+    }
+    close(client);
+  }
+  close(server);
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdint.h>
+
+#include "libssim.h"
+
+// Serves runs of the program loaded in vm on the local socket at path, with
+// the protocol described in server.c. Every connection gets a child forked
+// from vm as it is, so the image is loaded and verified only once, and the
+// pages of the child are copied only as it writes them. Runs until SIGINT or
+// SIGTERM. Returns non-zero if the socket can't be set up.
+int serve(VM *vm, const char *path, uint64_t max_steps);
+
+#endif
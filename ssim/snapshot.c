@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+#include "snapshot.h"
+
+// A snapshot is an image of the current DS and CS, so it can be loaded like
+// one, followed by SS[0, SS_TOP), ES[0, ES_TOP) and the state at the end.
+#define SNAPSHOT_MAGIC "SSNP"
+#define SNAPSHOT_VERSION 1
+
+typedef struct SnapshotState {
+  int16_t general_regs[8];
+  uint32_t PC;
+  uint32_t SS_TOP;
+  uint32_t ES_TOP;
+  uint32_t ds_size;
+  uint32_t cs_size;
+  uint8_t OF;
+  uint8_t CF;
+  uint8_t stopped;
+  uint8_t reserved;
+  uint64_t steps;
+  uint32_t version;
+  char magic[4];
+} SnapshotState;
+
+int snapshot_save(VM *vm, const char *file_name) {
+  SnapshotState state;
+  FILE *fp;
+  int ret = 0;
+
+  if (!vm->code) return -1;
+  memset(&state, 0, sizeof(state));
+  memcpy(state.general_regs, vm->general_regs, sizeof(state.general_regs));
+  state.PC = vm->PC;
+  state.SS_TOP = vm->SS_TOP;
+  state.ES_TOP = vm->ES_TOP;
+  state.ds_size = vm->DS_SIZE;
+  state.cs_size = vm->CS_SIZE;
+  state.OF = get_of(vm);
+  state.CF = vm->PSW.CF;
+  state.stopped = vm->stopped;
+  state.steps = vm->steps;
+  state.version = SNAPSHOT_VERSION;
+  memcpy(state.magic, SNAPSHOT_MAGIC, 4);
+
+  fp = fopen(file_name, "wb");
+  if (!fp) return -1;
+  if (1 != fwrite(&state.ds_size, 4, 1, fp) ||
+      1 != fwrite(&state.cs_size, 4, 1, fp) ||
+      vm->DS_SIZE != fwrite(vm->DS, 1, vm->DS_SIZE, fp) ||
+      vm->CS_SIZE != fwrite(vm->CS, 1, vm->CS_SIZE, fp) ||
+      vm->SS_TOP != fwrite(vm->SS, 1, vm->SS_TOP, fp) ||
+      vm->ES_TOP != fwrite(vm->ES, 1, vm->ES_TOP, fp) ||
+      1 != fwrite(&state, sizeof(state), 1, fp))
+    ret = -1;
+  if (0 != fclose(fp)) ret = -1;
+  return ret;
+}
+
+const char *snapshot_restore(VM *vm, const char *file_name) {
+  SnapshotState state;
+  long image_size = 8 + (long)vm->DS_SIZE + vm->CS_SIZE;
+  FILE *fp;
+
+  fp = fopen(file_name, "rb");
+  if (!fp) return "Can't open input file!";
+  // Images written by sas end right after CS.
+  if (0 != fseek(fp, -(long)sizeof(state), SEEK_END) ||
+      1 != fread(&state, sizeof(state), 1, fp) ||
+      0 != memcmp(state.magic, SNAPSHOT_MAGIC, 4)) {
+    fclose(fp);
+    return NULL;
+  }
+
+  if (SNAPSHOT_VERSION != state.version ||
+      state.ds_size != vm->DS_SIZE || state.cs_size != vm->CS_SIZE ||
+      ftell(fp) != image_size + state.SS_TOP + state.ES_TOP +
+                   (long)sizeof(state) ||
+      state.SS_TOP % 2 || state.ES_TOP % sizeof(Frame) ||
+      state.PC % 4 || state.PC > vm->CS_SIZE)
+    goto corrupted;
+  if (state.SS_TOP > vm->ss_size || state.ES_TOP > vm->es_size) {
+    fclose(fp);
+    return "Snapshot needs bigger stacks!";
+  }
+  if (0 != fseek(fp, image_size, SEEK_SET) ||
+      state.SS_TOP != fread(vm->SS, 1, state.SS_TOP, fp) ||
+      state.ES_TOP != fread(vm->ES, 1, state.ES_TOP, fp))
+    goto corrupted;
+  fclose(fp);
+
+  memcpy(vm->general_regs, state.general_regs, sizeof(state.general_regs));
+  vm->PC = state.PC;
+  vm->SS_TOP = state.SS_TOP;
+  vm->ES_TOP = state.ES_TOP;
+  set_of(vm, state.OF);
+  vm->PSW.CF = state.CF;
+  vm->stopped = state.stopped;
+  vm->steps = state.steps;
+  return NULL;
+
+corrupted:
+  fclose(fp);
+  return "Snapshot file corrupted!";
+}
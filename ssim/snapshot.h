@@ -0,0 +1,13 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "vm.h"
+
+// Writes a snapshot of vm, see vm_save(). Returns non-zero on error.
+int snapshot_save(VM *vm, const char *file_name);
+
+// Restores the state saved after the image, if file_name is a snapshot.
+// The image must already be loaded. Returns the error message or NULL.
+const char *snapshot_restore(VM *vm, const char *file_name);
+
+#endif
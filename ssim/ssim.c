@@ -1,419 +1,343 @@
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
-#include <stdint.h>
-#include <stdbool.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "libssim.h"
+#include "batch.h"
+#include "debugger.h"
+#include "lockstep.h"
+#include "server.h"
+#include "scheduler.h"
+
+// Engine used when none is given on the command line.
+// Build with -DDEFAULT_ENGINE=VM_ENGINE_THREADED to change it.
+#ifndef DEFAULT_ENGINE
+#define DEFAULT_ENGINE VM_ENGINE_CALL
+#endif
+
+// Ring buffer of the trace, in megabytes.
+#define DEFAULT_TRACE_SIZE 64
+
+// Steps run between checks for a checkpoint request or the time limit.
+#define RUN_SLICE (1 << 24)
+
+VM *g_vm;
+const char *g_trace_file;
+const char *g_checkpoint_file;
+volatile sig_atomic_t g_checkpoint_requested;
 
-#define STACK_SIZE 4096
-#define ES_SIZE 4096
-#define ADDR_MASK ((uint32_t)0xffffff)
-#define IMMEDIATE_MASK ((uint32_t)0xffff)
-#define PORT_MASK ((uint32_t)0xff)
-
-// The struct represents the states of a running virtual machine.
-typedef struct {
-  int16_t general_regs[8]; // Z:0 A:1 B:2 C:3 D:4 E:5 F:6 G:7
-
-  uint8_t *CS;
-  uint8_t *DS;
-  uint8_t *SS;
-  uint8_t *ES; // Uses to store a copy of general_regs during function calls.
-
-  uint32_t PC;
-  uint32_t IR;
-  uint32_t SS_TOP;
-  uint32_t ES_TOP;
-
-  struct {
-    unsigned int OF : 1;
-    unsigned int CF : 1;
-    unsigned int    : 14;
-  } PSW;
-
-  bool stopped;
-}__attribute__((packed)) VMState;
-
-// Global state.
-VMState g_vm_state;
-
-// Shorthands.
-#define OPCODE() ((g_vm_state.IR) >> 27)
-#define REG0() ((g_vm_state.IR>>24) & 0x7)
-#define REG1() ((g_vm_state.IR>>20) & 0xf)
-#define REG2() ((g_vm_state.IR>>16) & 0xf)
-#define ADDR() (g_vm_state.IR & ADDR_MASK)
-#define IMMEDIATE() (uint16_t)(g_vm_state.IR & IMMEDIATE_MASK)
-#define PORT() (g_vm_state.IR & PORT_MASK)
-#define REG0_VAL (g_vm_state.general_regs[REG0()]) 
-#define REG1_VAL (g_vm_state.general_regs[REG1()]) 
-#define REG2_VAL (g_vm_state.general_regs[REG2()]) 
-#define REGG_VAL (g_vm_state.general_regs[7])
-
-// Forward declarations.
-int do_hlt();
-int do_jmp();
-int do_cjmp();
-int do_ojmp();
-int do_call();
-int do_ret();
-int do_push();
-int do_pop();
-int do_loadb();
-int do_loadw();
-int do_storeb();
-int do_storew();
-int do_loadi();
-int do_nop();
-int do_in();
-int do_out();
-int do_add();
-int do_addi();
-int do_sub();
-int do_subi();
-int do_mul();
-int do_div();
-int do_and();
-int do_or();
-int do_nor();
-int do_notb();
-int do_sal();
-int do_sar();
-int do_equ();
-int do_lt();
-int do_lte();
-int do_notc();
-void error(char *msg);
-    
-// This table maps instruction code to corresponding simulation function.
-int (*g_func_map[])() = {do_hlt, do_jmp, do_cjmp, do_ojmp, do_call,    //4
-                         do_ret, do_push, do_pop, do_loadb, do_loadw,  //9
-                         do_storeb, do_storew, do_loadi, do_nop, do_in,//14
-                         do_out, do_add, do_addi, do_sub, do_subi,     //19
-                         do_mul, do_div, do_and, do_or, do_nor,        //24
-                         do_notb, do_sal, do_sar, do_equ, do_lt,       //29
-                         do_lte, do_notc};                             //31
-
-int do_hlt() {
-  g_vm_state.stopped = true;
-  return 0;
+// Print error massage and exit.
+void error(const char *msg) {
+  printf("Error: %s\n", msg);
+  exit(EXIT_FAILURE);
 }
 
-int do_jmp() {
-  g_vm_state.PC = ADDR() - 4;
-  return 0;
+// Release all the resources.
+void destroy_vm() {
+  vm_destroy(g_vm);
 }
 
-int do_cjmp() {
-  if (g_vm_state.PSW.CF)
-    g_vm_state.PC = ADDR() - 4;
-  return 0;
-}
+// Writes the trace, with only async-signal-safe calls.
+void write_trace() {
+  int fd = open(g_trace_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
 
-int do_ojmp() {
-  if (g_vm_state.PSW.OF)
-    g_vm_state.PC = ADDR() - 4;
-  return 0;
+  if (fd < 0) return;
+  vm_write_trace(g_vm, fd);
+  close(fd);
 }
 
-int do_call() {
-  // We need to save general_regs and PC during CALL. (2*8+4+4 = 24).
-  if (g_vm_state.ES_TOP + 24 > ES_SIZE) {
-    puts("Extended-Stack overflow!");
-    return -1;
-  }
-  memcpy(g_vm_state.ES + g_vm_state.ES_TOP, g_vm_state.general_regs, 16);
-  memcpy(g_vm_state.ES + g_vm_state.ES_TOP + 16, &g_vm_state.PC, 4);
-  memcpy(g_vm_state.ES + g_vm_state.ES_TOP + 20, &g_vm_state.PSW, 4);
-  g_vm_state.ES_TOP += 24;
-  g_vm_state.PC = ADDR() - 4;
-  return 0;
+// SIGUSR1 writes the trace so far, SIGINT and SIGTERM write it and quit.
+void on_signal(int sig) {
+  write_trace();
+  if (SIGUSR1 == sig) return;
+  signal(sig, SIG_DFL);
+  raise(sig);
 }
 
-int do_ret() {
-  if (g_vm_state.ES_TOP  < 24) {
-    // The outter most RET. Program exits normally.
-    g_vm_state.stopped = true;
-    return 0;
-  }
-  g_vm_state.ES_TOP -= 24;
-  memcpy(g_vm_state.general_regs, g_vm_state.ES + g_vm_state.ES_TOP, 16);
-  memcpy(&g_vm_state.PC, g_vm_state.ES + g_vm_state.ES_TOP + 16, 4);
-  memcpy(&g_vm_state.PSW, g_vm_state.ES + g_vm_state.ES_TOP + 20, 4);
-  return 0;
+void on_checkpoint_signal(int sig) {
+  g_checkpoint_requested = 1;
 }
 
-int do_push() {
-  if (g_vm_state.SS_TOP + 2 > STACK_SIZE) {
-    puts("Stack overflow!");
-    return -1;
-  }
-  *(int16_t *)(g_vm_state.SS+g_vm_state.SS_TOP) = REG0_VAL;
-  g_vm_state.SS_TOP += 2;
-  return 0;
-}
+// Saves a checkpoint through a temporary file, so the last one is kept if
+// writing fails.
+void checkpoint() {
+  char *tmp = malloc(strlen(g_checkpoint_file) + 5);
 
-int do_pop() {
-  if (REG0() == 0) return -1;
-  if (g_vm_state.SS_TOP < 2) {
-    puts("Stack underflow!");
-    return -1;
+  if (!tmp) error("Out of memory!");
+  sprintf(tmp, "%s.tmp", g_checkpoint_file);
+  if (0 != vm_save(g_vm, tmp) || 0 != rename(tmp, g_checkpoint_file)) {
+    remove(tmp);
+    error("Can't write checkpoint file!");
   }
-  g_vm_state.SS_TOP -= 2;
-  REG0_VAL = *(int16_t *)(g_vm_state.SS+g_vm_state.SS_TOP);
-  return 0;
-}
-
-int do_loadb() {
-  REG0_VAL = g_vm_state.DS[ADDR() + REGG_VAL];
-  return 0;
-}
-
-int do_loadw() {
-  if (REG0() == 0) return -1;
-  REG0_VAL = *(int16_t *)(g_vm_state.DS + ADDR() + REGG_VAL*2);
-  return 0;
-}
-
-int do_storeb() {
-  g_vm_state.DS[ADDR() + REGG_VAL] =  g_vm_state.general_regs[REG0()];
-  return 0;
-}
-
-int do_storew() {
-  *(int16_t *)(g_vm_state.DS + ADDR() + REGG_VAL*2) = REG0_VAL;
-  return 0;
-}
-
-int do_loadi() {
-  if (REG0() == 0) return -1;
-  REG0_VAL = IMMEDIATE();
-  return 0;
+  free(tmp);
+}
+
+uint64_t now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Runs the program until it stops, or ran max_steps instructions or for
+// max_ms milliseconds (0 for no limit), returning VM_RUNNING then. With a
+// checkpoint file, saves a checkpoint after at steps, then every every steps,
+// and on SIGUSR2.
+// The engines only check the step limit where the control flow goes
+// elsewhere, the time is checked between slices of RUN_SLICE steps.
+VMStatus run_limited(uint64_t max_steps, uint64_t max_ms, uint64_t at,
+                     uint64_t every) {
+  uint64_t next = at ? at : every, steps, deadline = now_ms() + max_ms;
+  VMStatus status;
+
+  if (!g_checkpoint_file) next = 0;
+  // Resumed past it.
+  if (next && next <= vm_steps(g_vm))
+    next = every ? vm_steps(g_vm) + every : 0;
+  if (g_checkpoint_file) signal(SIGUSR2, on_checkpoint_signal);
+  do {
+    steps = RUN_SLICE;
+    if (next && next - vm_steps(g_vm) < steps) steps = next - vm_steps(g_vm);
+    if (max_steps && max_steps - vm_steps(g_vm) < steps)
+      steps = max_steps - vm_steps(g_vm);
+    status = vm_run(g_vm, steps);
+    if (next && vm_steps(g_vm) >= next) {
+      g_checkpoint_requested = 1;
+      next = every ? vm_steps(g_vm) + every : 0;
+    }
+    if (VM_RUNNING == status && g_checkpoint_requested) {
+      g_checkpoint_requested = 0;
+      checkpoint();
+    }
+  } while (VM_RUNNING == status &&
+           (!max_steps || vm_steps(g_vm) < max_steps) &&
+           (!max_ms || now_ms() < deadline));
+  return status;
 }
 
-int do_nop() {
-  return 0;
+void usage_and_die() {
+  printf("Usage: ssim [--engine=call|threaded|jit] [--no-fuse] "
+         "[--flush-interval=ms]\n"
+         "            [--ss-size=kb] [--es-size=kb]\n"
+         "            [--profile=report_file [--list=list_file]]\n"
+         "            [--counters=report_file] [--verify]\n"
+         "            [--trace=trace_file [--trace-size=mb]]\n"
+         "            [--checkpoint=snapshot_file [--checkpoint-at=n] "
+         "[--checkpoint-every=n]]\n"
+         "            [--max-instructions=n] [--time-limit=ms]\n"
+         "            [--debug=socket_path|- [--history=mb]]\n"
+         "            [--serve=socket_path] [--host=socket_path]\n"
+         "            file_name|snapshot_file\n"
+         "       ssim --print-trace=trace_file\n"
+         "       ssim [--engine=call|threaded|jit] [--no-fuse] "
+         "[--ss-size=kb] [--es-size=kb]\n"
+         "            [--max-instructions=n] "
+         "--verify-against=call|threaded|jit file_name\n"
+         "       ssim [--engine=call|threaded|jit] [--no-fuse] "
+         "[--ss-size=kb] [--es-size=kb]\n"
+         "            --batch=summary_file [--jobs=n] [--max-steps=n] "
+         "manifest_file\n");
+  exit(EXIT_FAILURE);
 }
 
-int do_in() {
-  if (REG0() == 0) return -1;
-  if (PORT() != 0) {
-    puts("Invalid input port!");
-    return -1;
+int main(int argc, char *argv[]) {
+  char *file_name = NULL;
+  VMEngine engine = DEFAULT_ENGINE;
+  bool fuse = true;
+  size_t ss_size = 0, es_size = 0;
+  char *flush_interval = NULL;
+  char *profile = NULL, *list_file = "list.txt";
+  char *counters = NULL;
+  bool verify = false;
+  size_t trace_size = DEFAULT_TRACE_SIZE;
+  uint64_t checkpoint_at = 0, checkpoint_every = 0;
+  uint64_t max_instructions = 0, time_limit = 0;
+  char *debug = NULL;
+  char *server = NULL;
+  SchedulerOptions host = {0};
+  size_t history_size = 0;
+  BatchOptions batch = {0};
+  LockstepOptions lockstep = {0};
+  bool verify_against = false;
+  VMStatus status;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--engine=call")) {
+      engine = VM_ENGINE_CALL;
+    } else if (!strcmp(argv[i], "--engine=threaded")) {
+      engine = VM_ENGINE_THREADED;
+    } else if (!strcmp(argv[i], "--engine=jit")) {
+      engine = VM_ENGINE_JIT;
+    } else if (!strcmp(argv[i], "--no-fuse")) {
+      fuse = false;
+    } else if (!strncmp(argv[i], "--ss-size=", 10)) {
+      ss_size = strtoull(argv[i] + 10, NULL, 10) << 10;
+    } else if (!strncmp(argv[i], "--es-size=", 10)) {
+      es_size = strtoull(argv[i] + 10, NULL, 10) << 10;
+    } else if (!strncmp(argv[i], "--flush-interval=", 17)) {
+      flush_interval = argv[i] + 17;
+    } else if (!strncmp(argv[i], "--profile=", 10)) {
+      profile = argv[i] + 10;
+    } else if (!strncmp(argv[i], "--counters=", 11)) {
+      counters = argv[i] + 11;
+    } else if (!strcmp(argv[i], "--verify")) {
+      verify = true;
+    } else if (!strncmp(argv[i], "--list=", 7)) {
+      list_file = argv[i] + 7;
+    } else if (!strncmp(argv[i], "--trace=", 8)) {
+      g_trace_file = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--trace-size=", 13)) {
+      trace_size = strtoull(argv[i] + 13, NULL, 10);
+    } else if (!strncmp(argv[i], "--print-trace=", 14)) {
+      FILE *fp = fopen(argv[i] + 14, "rb");
+
+      if (!fp) error("Can't open trace file!");
+      if (0 != vm_print_trace(fp, stdout)) error("Trace file corrupted!");
+      fclose(fp);
+      return 0;
+    } else if (!strncmp(argv[i], "--checkpoint=", 13)) {
+      g_checkpoint_file = argv[i] + 13;
+    } else if (!strncmp(argv[i], "--checkpoint-at=", 16)) {
+      checkpoint_at = strtoull(argv[i] + 16, NULL, 10);
+    } else if (!strncmp(argv[i], "--checkpoint-every=", 19)) {
+      checkpoint_every = strtoull(argv[i] + 19, NULL, 10);
+    } else if (!strncmp(argv[i], "--max-instructions=", 19)) {
+      max_instructions = strtoull(argv[i] + 19, NULL, 10);
+    } else if (!strncmp(argv[i], "--time-limit=", 13)) {
+      time_limit = strtoull(argv[i] + 13, NULL, 10);
+    } else if (!strncmp(argv[i], "--debug=", 8)) {
+      debug = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--serve=", 8)) {
+      server = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--host=", 7)) {
+      host.path = argv[i] + 7;
+    } else if (!strncmp(argv[i], "--history=", 10)) {
+      history_size = strtoull(argv[i] + 10, NULL, 10);
+    } else if (!strcmp(argv[i], "--verify-against=call")) {
+      verify_against = true;
+      lockstep.reference = VM_ENGINE_CALL;
+    } else if (!strcmp(argv[i], "--verify-against=threaded")) {
+      verify_against = true;
+      lockstep.reference = VM_ENGINE_THREADED;
+    } else if (!strcmp(argv[i], "--verify-against=jit")) {
+      verify_against = true;
+      lockstep.reference = VM_ENGINE_JIT;
+    } else if (!strncmp(argv[i], "--batch=", 8)) {
+      batch.summary = argv[i] + 8;
+    } else if (!strncmp(argv[i], "--jobs=", 7)) {
+      batch.threads = atoi(argv[i] + 7);
+    } else if (!strncmp(argv[i], "--max-steps=", 12)) {
+      batch.max_steps = strtoull(argv[i] + 12, NULL, 10);
+    } else if (!strncmp(argv[i], "--", 2) || file_name) {
+      usage_and_die();
+    } else {
+      file_name = argv[i];
+    }
   }
-  REG0_VAL = getchar();
-  return 0;
-}
-
-int do_out() {
-  if (PORT() != 15) {
-    puts("Invalid output port!");
-    return -1;
+  if (!file_name) usage_and_die();
+
+  g_vm = vm_create();
+  if (!g_vm) error("Out of memory!");
+  atexit(destroy_vm); // For a clean exit;
+  if (0 != vm_set_engine(g_vm, engine))
+    error("Engine not supported by this build!");
+  vm_set_fuse(g_vm, fuse);
+  if (0 != vm_set_stack_sizes(g_vm, ss_size, es_size))
+    error("Stack size too big!");
+  if (flush_interval) vm_set_flush_interval(g_vm, atoi(flush_interval));
+  if (profile) vm_set_profile(g_vm, true);
+  if (counters) vm_set_counters(g_vm, true);
+  if (g_trace_file) vm_set_trace(g_vm, trace_size << 20);
+  if (history_size) vm_set_history(g_vm, history_size << 20);
+  // The commands come from stdin.
+  if (debug && !strcmp(debug, "-")) {
+    FILE *in = fopen("/dev/null", "r");
+
+    if (!in) error("Can't open /dev/null!");
+    vm_set_io(g_vm, in, stdout);
   }
-  putchar(REG0_VAL);
-  fflush(stdout);
-  return 0;
-}
-
-void check_overflow(int32_t result) {
-  if (result < (int16_t)(0x8000) || result > (int16_t)(0x7fff))
-    g_vm_state.PSW.OF = 1;
-  else
-    g_vm_state.PSW.OF = 0;
-}
-
-int do_add() {
-  if (REG0() == 0) return -1;
-  int32_t result = REG1_VAL + REG2_VAL;
-  check_overflow(result);
-  REG0_VAL = result;  
-  return 0;
-}
 
-int do_addi() {
-  if (REG0() == 0) return -1;
-  int32_t result = REG0_VAL + IMMEDIATE();
-  check_overflow(result);
-  REG0_VAL = result;  
-  return 0;
-}
-
-int do_sub() {
-  if (REG0() == 0) return -1;
-  int32_t result = REG1_VAL - REG2_VAL;
-  check_overflow(result);
-  REG0_VAL = result;  
-  return 0;
-}
-
-int do_subi() {
-  if (REG0() == 0) return -1;
-  int32_t result = REG0_VAL - IMMEDIATE();
-  check_overflow(result);
-  REG0_VAL = result;  
-  return 0;
-}
-
-int do_mul() {
-  if (REG0() == 0) return -1;
-  int32_t result = REG1_VAL * REG2_VAL;
-  check_overflow(result);
-  REG0_VAL = result;  
-  return 0;
-}
-
-int do_div() {
-  if (REG0() == 0) return -1;
-  if (REG2_VAL == 0) {
-    puts("0-div!");
-    return -1;
+  if (batch.summary) {
+    batch.manifest = file_name;
+    batch.engine = engine;
+    batch.fuse = fuse;
+    batch.ss_size = ss_size;
+    batch.es_size = es_size;
+    return 0 == run_batch(&batch) ? 0 : EXIT_FAILURE;
   }
-  int32_t result = REG1_VAL / REG2_VAL;
-  check_overflow(result);
-  REG0_VAL = result;  
-  return 0;
-}
-
-int do_and() {
-  if (REG0() == 0) return -1;
-  REG0_VAL = REG1_VAL & REG2_VAL;
-  return 0;
-}
-
-int do_or() {
-  if (REG0() == 0) return -1;
-  REG0_VAL = REG1_VAL | REG2_VAL;
-  return 0;
-}
-
-int do_nor() {
-  if (REG0() == 0) return -1;
-  REG0_VAL = REG1_VAL ^ REG2_VAL;
-  return 0;
-}
-
-int do_notb() {
-  if (REG0() == 0) return -1;
-  REG0_VAL = ~REG1_VAL;
-  return 0;
-}
-
-int do_sal() {
-  if (REG0() == 0) return -1;
-  REG0_VAL = REG1_VAL << REG2_VAL;
-  return 0;
-}
-
-int do_sar() {
-  if (REG0() == 0) return -1;
-  uint16_t result = REG1_VAL;
-  for (int i = 0; i < REG2_VAL && i < 16; ++i) {
-    result >>= 1;
-    result |= (result << 1) & 0x8000;
+  if (verify_against) {
+    lockstep.image = file_name;
+    lockstep.engine = engine;
+    lockstep.fuse = fuse;
+    lockstep.ss_size = ss_size;
+    lockstep.es_size = es_size;
+    lockstep.max_steps = max_instructions;
+    return run_lockstep(&lockstep);
+  }
+  if (0 != vm_load(g_vm, file_name))
+    error(vm_error(g_vm));
+  if (verify && 0 != vm_verify(g_vm, stdout))
+    error("Verification failed!");
+  if (server) {
+    if (0 != serve(g_vm, server, max_instructions))
+      error("Can't open server socket!");
+    return 0;
+  }
+  if (host.path) {
+    host.image = file_name;
+    host.engine = engine;
+    host.fuse = fuse;
+    host.ss_size = ss_size;
+    host.es_size = es_size;
+    host.max_steps = max_instructions;
+    if (0 != run_scheduler(&host)) error("Can't open host socket!");
+    return 0;
   }
-  REG0_VAL = result;
-  return 0;
-}
-
-int do_equ() {
-  if (REG0_VAL == REG1_VAL)
-    g_vm_state.PSW.CF = 1;
-  else
-    g_vm_state.PSW.CF = 0;
-  return 0;
-}
-
-int do_lt() {
-  if (REG0_VAL < REG1_VAL)
-    g_vm_state.PSW.CF = 1;
-  else
-    g_vm_state.PSW.CF = 0;
-  return 0;
-}
-
-int do_lte() {
-  if (REG0_VAL <= REG1_VAL)
-    g_vm_state.PSW.CF = 1;
-  else
-    g_vm_state.PSW.CF = 0;
-  return 0;
-}
-
-int do_notc() {
-  g_vm_state.PSW.CF = ~g_vm_state.PSW.CF;
-  return 0;
-}
-
-// Print error massage and exit.
-void error(char *msg) {
-  printf("Error: %s\n", msg);
-  exit(EXIT_FAILURE);
-}
-
-void init_vm_state(char *argv[]) {
-  uint32_t ds_size, cs_size;
-  FILE *fp;
-
-  fp = fopen(argv[1], "rb");
-  if (!fp) error("Can't open input file!");
-  fread(&ds_size, 4, 1, fp);
-  fread(&cs_size, 4, 1, fp);
-
-  memset(&g_vm_state, 0, sizeof(VMState));
-  
-  // Load code and data.
-  g_vm_state.DS = malloc(ds_size);
-  if (!g_vm_state.DS) error("Out of memory!");
-  if (1 != fread(g_vm_state.DS, ds_size, 1, fp))
-    error("Input file corrupted!");
-  
-  g_vm_state.CS = malloc(cs_size);
-  if (!g_vm_state.CS) error("Out of memory!");
-  if (1 != fread(g_vm_state.CS, cs_size, 1, fp))
-    error("Input file corrupted!");
-
-  // Allocate stack and extended segment.
-  g_vm_state.SS = malloc(STACK_SIZE);
-  if (!g_vm_state.SS) error("Out of memory!");
-
-  g_vm_state.ES = malloc(ES_SIZE);
-  if (!g_vm_state.ES) error("Out of memory!");
-
-  fclose(fp);
-}
-
-// Release all the resources.
-void destroy_vm_state() {
-  free(g_vm_state.DS);
-  free(g_vm_state.CS);
-  free(g_vm_state.SS);
-  free(g_vm_state.ES);
-}
 
-void usage_and_die() {
-  printf("Usage: ssim file_name\n");
-  exit(EXIT_FAILURE);
-}
+  if (g_trace_file) {
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGUSR1, on_signal);
+  }
+  if (debug) {
+    if (0 != debug_serve(g_vm, debug)) error("Can't open debug socket!");
+    status = VM_STOPPED; // The debugger reported how it ended.
+  } else {
+    status = run_limited(max_instructions, time_limit, checkpoint_at,
+                         checkpoint_every);
+  }
+  if (g_trace_file) write_trace();
+  if (profile) {
+    FILE *fp = fopen(profile, "w");
 
-int main(int argc, char *argv[]) {
-  if (argc < 2) usage_and_die();
+    if (!fp) error("Can't open profile file!");
+    vm_write_profile(g_vm, fp, list_file);
+    fclose(fp);
+  }
+  if (counters) {
+    FILE *fp = fopen(counters, "w");
 
-  uint32_t opcode;
-  
-  atexit(destroy_vm_state); // For a clean exit;
-  init_vm_state(argv);
-  g_vm_state.IR = *(uint32_t *)(g_vm_state.CS + g_vm_state.PC);
-  // The load-decode-eval loop.
-  while (!g_vm_state.stopped) {
-    opcode = OPCODE();
-    if (opcode > 31) error("Invalid opcode!");
-    //    printf("PC: %d\n", g_vm_state.PC);
-    if (0 != (*g_func_map[opcode])()) {
-      printf("PC: %d\n", g_vm_state.PC);
-      error("Execution error!");
-    }
-    g_vm_state.PC += 4;
-    g_vm_state.IR = *(uint32_t *)(g_vm_state.CS + g_vm_state.PC);
+    if (!fp) error("Can't open counters file!");
+    vm_write_counters(g_vm, fp);
+    fclose(fp);
+  }
+  if (VM_ERROR == status) {
+    if (vm_error(g_vm)) puts(vm_error(g_vm));
+    printf("PC: %d\n", vm_pc(g_vm));
+    error("Execution error!");
   }
-  
+  if (VM_RUNNING == status) {
+    printf("%s limit reached after %llu instructions!\n",
+           max_instructions && vm_steps(g_vm) >= max_instructions ?
+           "Instruction" : "Time", (unsigned long long)vm_steps(g_vm));
+    printf("PC: %d\n", vm_pc(g_vm));
+    return EXIT_LIMIT;
+  }
+
   return 0;
 }
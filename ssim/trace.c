@@ -0,0 +1,355 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "vm.h"
+#include "trace.h"
+
+// A record is a flags byte, followed by what the flags say:
+//   TRACE_JUMP   PC - the expected PC, in instructions, as a varint.
+//   TRACE_REGS   A mask of the changed registers, then each new value.
+//   TRACE_LOAD   DS index - the one of the last access as a varint, then
+//   TRACE_STORE  the byte, or the word with TRACE_WORD.
+//   TRACE_PSW    OF | CF << 1.
+// Numbers are in host byte order.
+#define TRACE_JUMP 0x01
+#define TRACE_REGS 0x02
+#define TRACE_LOAD 0x04
+#define TRACE_STORE 0x08
+#define TRACE_WORD 0x10
+#define TRACE_PSW 0x20
+
+#define MAX_RECORD 32
+#define NO_ACCESS INT32_MIN
+
+#define TRACE_MAGIC "STRC"
+#define TRACE_VERSION 1
+
+// Starts every chunk, with the state its first record is relative to.
+typedef struct TraceChunk {
+  uint64_t step;  // Step of the first record.
+  uint32_t pc;    // PC of the first record.
+  uint32_t used;  // Bytes of records, set once the chunk is full.
+} TraceChunk;
+
+// Starts the file, followed by the chunks from the oldest one.
+typedef struct TraceHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t chunk_size;
+  uint32_t chunk_num;
+  // How the run ended up.
+  uint64_t steps;
+  uint32_t pc;
+  uint32_t status;
+  uint32_t error_len; // The message follows the header.
+  uint32_t reserved;
+} TraceHeader;
+
+Trace *trace_create(size_t size) {
+  Trace *trace = calloc(1, sizeof(Trace));
+
+  if (!trace) return NULL;
+  // Keep at least one full chunk when the ring wraps.
+  trace->chunk_num = size / TRACE_CHUNK_SIZE;
+  if (trace->chunk_num < 2) trace->chunk_num = 2;
+  trace->chunks = malloc(trace->chunk_num * TRACE_CHUNK_SIZE);
+  if (!trace->chunks) {
+    free(trace);
+    return NULL;
+  }
+  return trace;
+}
+
+void trace_destroy(Trace *trace) {
+  if (!trace) return;
+  free(trace->chunks);
+  free(trace);
+}
+
+static TraceChunk *chunk_at(Trace *trace, size_t k) {
+  return (TraceChunk *)(trace->chunks + k * TRACE_CHUNK_SIZE);
+}
+
+// Moves to the next chunk, dropping the oldest one if the ring is full.
+static void next_chunk(Trace *trace, uint64_t step, uint32_t pc) {
+  TraceChunk *chunk;
+
+  if (trace->started) {
+    chunk = chunk_at(trace, trace->head);
+    chunk->used = trace->pos - (uint8_t *)(chunk + 1);
+    trace->head = (trace->head + 1) % trace->chunk_num;
+  }
+  ++trace->started;
+
+  chunk = chunk_at(trace, trace->head);
+  chunk->step = step;
+  chunk->pc = pc;
+  chunk->used = 0;
+  trace->pos = (uint8_t *)(chunk + 1);
+  trace->end = (uint8_t *)chunk + TRACE_CHUNK_SIZE;
+  trace->next_pc = pc;
+  trace->index = 0;
+}
+
+static uint8_t psw_of(VM *vm) {
+  return get_of(vm) | vm->PSW.CF << 1;
+}
+
+void trace_before(Trace *trace, VM *vm, const Instr *instr) {
+  trace->pc = vm->PC;
+  memcpy(trace->regs, vm->general_regs, sizeof(trace->regs));
+  trace->psw = psw_of(vm);
+
+  switch (base_opcode(instr->opcode)) {
+    case OP_LOADB:
+    case OP_STOREB:
+      trace->access = (int32_t)instr->addr + vm->general_regs[7];
+      break;
+    case OP_LOADW:
+    case OP_STOREW:
+      trace->access = (int32_t)instr->addr + vm->general_regs[7] * 2;
+      break;
+    default:
+      trace->access = NO_ACCESS;
+  }
+}
+
+static uint8_t *put_varint(uint8_t *pos, int32_t value) {
+  // Zigzag, so small negative deltas stay short.
+  uint32_t u = ((uint32_t)value << 1) ^ (uint32_t)(value >> 31);
+
+  while (u >= 0x80) {
+    *pos++ = u | 0x80;
+    u >>= 7;
+  }
+  *pos++ = u;
+  return pos;
+}
+
+void trace_after(Trace *trace, VM *vm, const Instr *instr) {
+  uint8_t flags = 0, *pos, mask = 0;
+  Opcode opcode = base_opcode(instr->opcode);
+
+  if (!trace->pos || trace->end - trace->pos < MAX_RECORD)
+    next_chunk(trace, vm->steps, trace->pc);
+  pos = trace->pos + 1;
+
+  if (trace->pc != trace->next_pc) {
+    flags |= TRACE_JUMP;
+    pos = put_varint(pos, (int32_t)(trace->pc / 4 - trace->next_pc / 4));
+  }
+
+  for (int r = 0; r < 8; ++r)
+    if (trace->regs[r] != vm->general_regs[r]) mask |= 1 << r;
+  if (mask) {
+    flags |= TRACE_REGS;
+    *pos++ = mask;
+    for (int r = 0; r < 8; ++r) {
+      if (!(mask & 1 << r)) continue;
+      memcpy(pos, &vm->general_regs[r], 2);
+      pos += 2;
+    }
+  }
+
+  if (NO_ACCESS != trace->access) {
+    flags |= OP_LOADB == opcode || OP_LOADW == opcode ?
+             TRACE_LOAD : TRACE_STORE;
+    pos = put_varint(pos, trace->access - trace->index);
+    trace->index = trace->access;
+    if (OP_LOADW == opcode || OP_STOREW == opcode) {
+      flags |= TRACE_WORD;
+      memcpy(pos, vm->DS + trace->access, 2);
+      pos += 2;
+    } else {
+      *pos++ = vm->DS[trace->access];
+    }
+  }
+
+  if (trace->psw != psw_of(vm)) {
+    flags |= TRACE_PSW;
+    *pos++ = psw_of(vm);
+  }
+
+  *trace->pos = flags;
+  trace->pos = pos;
+  trace->next_pc = trace->pc + 4;
+}
+
+// write() until it's all out, only async-signal-safe calls here.
+static int write_all(int fd, const void *data, size_t size) {
+  const uint8_t *p = data;
+  ssize_t n;
+
+  while (size > 0) {
+    n = write(fd, p, size);
+    if (n < 0 && EINTR == errno) continue;
+    if (n <= 0) return -1;
+    p += n;
+    size -= n;
+  }
+  return 0;
+}
+
+int trace_write(VM *vm, int fd) {
+  Trace *trace = vm->trace;
+  TraceHeader header;
+  TraceChunk *chunk;
+  size_t first = 0, num = 0;
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, 4);
+  header.version = TRACE_VERSION;
+  header.chunk_size = TRACE_CHUNK_SIZE;
+  if (trace && trace->started) {
+    num = trace->started;
+    if (num > trace->chunk_num) {
+      num = trace->chunk_num;
+      first = (trace->head + 1) % trace->chunk_num;
+    }
+    chunk = chunk_at(trace, trace->head);
+    chunk->used = trace->pos - (uint8_t *)(chunk + 1);
+  }
+  header.chunk_num = num;
+  header.steps = vm->steps;
+  header.pc = vm->PC;
+  header.status = vm->failed ? VM_ERROR : vm->stopped ? VM_STOPPED : VM_RUNNING;
+  header.error_len = vm->error ? strlen(vm->error) : 0;
+
+  if (0 != write_all(fd, &header, sizeof(header)) ||
+      0 != write_all(fd, vm->error, header.error_len))
+    return -1;
+  for (size_t k = 0; k < num; ++k) {
+    chunk = chunk_at(trace, (first + k) % trace->chunk_num);
+    if (0 != write_all(fd, chunk, sizeof(TraceChunk) + chunk->used))
+      return -1;
+  }
+  return 0;
+}
+
+static const uint8_t *get_varint(const uint8_t *pos, const uint8_t *end,
+                                 int32_t *value) {
+  uint32_t u = 0;
+
+  for (int shift = 0; pos < end && shift < 35; shift += 7) {
+    u |= (uint32_t)(*pos & 0x7f) << shift;
+    if (!(*pos++ & 0x80)) {
+      *value = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+      return pos;
+    }
+  }
+  return NULL;
+}
+
+// Prints the records of one chunk, one line per instruction.
+static int print_chunk(const TraceChunk *chunk, const uint8_t *pos,
+                       FILE *out) {
+  static const char *names = "ZABCDEFG";
+  const uint8_t *end = pos + chunk->used;
+  uint64_t step = chunk->step;
+  uint32_t pc = chunk->pc;
+  int32_t index = 0, delta;
+  int16_t word;
+  uint8_t flags, mask;
+
+  while (pos < end) {
+    flags = *pos++;
+    if (flags & TRACE_JUMP) {
+      if (!(pos = get_varint(pos, end, &delta))) return -1;
+      pc += delta * 4;
+    }
+    fprintf(out, "%llu PC: %u", (unsigned long long)step, pc);
+
+    if (flags & TRACE_REGS) {
+      if (pos >= end) return -1;
+      mask = *pos++;
+      for (int r = 0; r < 8; ++r) {
+        if (!(mask & 1 << r)) continue;
+        if (end - pos < 2) return -1;
+        memcpy(&word, pos, 2);
+        pos += 2;
+        fprintf(out, " %c=%d", names[r], word);
+      }
+    }
+
+    if (flags & (TRACE_LOAD | TRACE_STORE)) {
+      if (!(pos = get_varint(pos, end, &delta))) return -1;
+      index += delta;
+      if (flags & TRACE_WORD) {
+        if (end - pos < 2) return -1;
+        memcpy(&word, pos, 2);
+        pos += 2;
+      } else {
+        if (pos >= end) return -1;
+        word = *pos++;
+      }
+      fprintf(out, " DS[%d]%s%d", index, flags & TRACE_LOAD ? "->" : "<-",
+              word);
+    }
+
+    if (flags & TRACE_PSW) {
+      if (pos >= end) return -1;
+      fprintf(out, " OF=%d CF=%d", *pos & 1, *pos >> 1 & 1);
+      ++pos;
+    }
+
+    putc('\n', out);
+    ++step;
+    pc += 4;
+  }
+  return 0;
+}
+
+int trace_print(FILE *in, FILE *out) {
+  TraceHeader header;
+  TraceChunk chunk;
+  uint8_t *records = NULL;
+  char *error = NULL;
+  int ret = -1;
+
+  if (1 != fread(&header, sizeof(header), 1, in) ||
+      0 != memcmp(header.magic, TRACE_MAGIC, 4) ||
+      TRACE_VERSION != header.version ||
+      header.chunk_size != TRACE_CHUNK_SIZE)
+    return -1;
+
+  error = calloc(1, header.error_len + 1);
+  records = malloc(TRACE_CHUNK_SIZE);
+  if (!error || !records) goto done;
+  if (header.error_len && 1 != fread(error, header.error_len, 1, in))
+    goto done;
+
+  for (uint32_t k = 0; k < header.chunk_num; ++k) {
+    if (1 != fread(&chunk, sizeof(chunk), 1, in) ||
+        chunk.used > TRACE_CHUNK_SIZE - sizeof(chunk))
+      goto done;
+    if (chunk.used && 1 != fread(records, chunk.used, 1, in)) goto done;
+    if (0 != print_chunk(&chunk, records, out)) goto done;
+  }
+
+  switch (header.status) {
+    case VM_STOPPED:
+      fprintf(out, "Stopped after %llu steps at PC: %u\n",
+              (unsigned long long)header.steps, header.pc);
+      break;
+    case VM_ERROR:
+      fprintf(out, "Failed after %llu steps at PC: %u%s%s\n",
+              (unsigned long long)header.steps, header.pc,
+              header.error_len ? " " : "", error);
+      break;
+    default:
+      fprintf(out, "Running after %llu steps, next PC: %u\n",
+              (unsigned long long)header.steps, header.pc);
+  }
+  ret = 0;
+
+done:
+  free(error);
+  free(records);
+  return ret;
+}
@@ -0,0 +1,50 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "vm.h"
+
+// Bytes of a chunk of the ring buffer.
+#define TRACE_CHUNK_SIZE (64 << 10)
+
+// The execution trace of a VM, recorded by run_observed() one instruction at
+// a time. The ring buffer is split in chunks, each starting with absolute
+// state, so the oldest one can be dropped without losing the others.
+typedef struct Trace {
+  uint8_t *chunks;
+  size_t chunk_num;
+  size_t head;       // The chunk being written.
+  uint64_t started;  // Chunks started so far.
+  uint8_t *pos;      // Where the next record goes.
+  uint8_t *end;
+
+  // What the previous record left, for the deltas.
+  uint32_t next_pc;  // PC after it, unless it jumped.
+  int32_t index;     // DS index of the last load or store.
+
+  // State before the instruction being recorded.
+  uint32_t pc;
+  int16_t regs[8];
+  uint8_t psw;
+  int32_t access;    // DS index it loads or stores, if any.
+} Trace;
+
+// Returns NULL if out of memory.
+Trace *trace_create(size_t size);
+
+void trace_destroy(Trace *trace);
+
+// Called around running instr.
+void trace_before(Trace *trace, VM *vm, const Instr *instr);
+void trace_after(Trace *trace, VM *vm, const Instr *instr);
+
+// Writes the trace of vm to fd, see vm_write_trace().
+int trace_write(VM *vm, int fd);
+
+// See vm_print_trace().
+int trace_print(FILE *in, FILE *out);
+
+#endif
@@ -0,0 +1,1693 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "vm.h"
+#include "jit.h"
+#include "guard.h"
+#include "profile.h"
+#include "trace.h"
+#include "snapshot.h"
+#include "history.h"
+#include "watch.h"
+#include "counters.h"
+
+#define ADDR_MASK ((uint32_t)0xffffff)
+#define IMMEDIATE_MASK ((uint32_t)0xffff)
+#define PORT_MASK ((uint32_t)0xff)
+
+// Steps run between checks of the flush interval.
+#define FLUSH_SLICE (1 << 20)
+
+// The state the handlers touch fits in the first cache line of VM.
+_Static_assert(offsetof(VM, code) == CACHE_LINE_SIZE,
+               "Hot VM state doesn't fill one cache line!");
+
+// Labels-as-values are needed by the threaded engine.
+#ifdef __GNUC__
+#define HAVE_THREADED_ENGINE 1
+#endif
+
+// Shorthands for decoding a raw instruction code.
+#define CODE_OPCODE(ir) ((ir) >> 27)
+#define CODE_REG0(ir) (((ir)>>24) & 0x7)
+#define CODE_REG1(ir) (((ir)>>20) & 0xf)
+#define CODE_REG2(ir) (((ir)>>16) & 0xf)
+#define CODE_ADDR(ir) ((ir) & ADDR_MASK)
+#define CODE_IMMEDIATE(ir) (uint16_t)((ir) & IMMEDIATE_MASK)
+#define CODE_PORT(ir) ((ir) & PORT_MASK)
+
+// Shorthands used by the handlers, which all receive the decoded instruction.
+#define OPCODE() (instr->opcode)
+#define REG0() (instr->reg0)
+#define REG1() (instr->reg1)
+#define REG2() (instr->reg2)
+#define ADDR() (instr->addr)
+#define IMMEDIATE() (instr->immediate)
+#define PORT() (instr->port)
+#define REG0_VAL (vm->general_regs[REG0()]) 
+#define REG1_VAL (vm->general_regs[REG1()]) 
+#define REG2_VAL (vm->general_regs[REG2()]) 
+#define REGG_VAL (vm->general_regs[7])
+
+// Forward declarations.
+static handler_t do_hlt;
+static handler_t do_jmp;
+static handler_t do_cjmp;
+static handler_t do_ojmp;
+static handler_t do_call;
+static handler_t do_ret;
+static handler_t do_push;
+static handler_t do_pop;
+static handler_t do_loadb;
+static handler_t do_loadw;
+static handler_t do_storeb;
+static handler_t do_storew;
+static handler_t do_loadi;
+static handler_t do_nop;
+static handler_t do_in;
+static handler_t do_out;
+static handler_t do_add;
+static handler_t do_addi;
+static handler_t do_sub;
+static handler_t do_subi;
+static handler_t do_mul;
+static handler_t do_div;
+static handler_t do_and;
+static handler_t do_or;
+static handler_t do_nor;
+static handler_t do_notb;
+static handler_t do_sal;
+static handler_t do_sar;
+static handler_t do_equ;
+static handler_t do_lt;
+static handler_t do_lte;
+static handler_t do_notc;
+static handler_t do_bad_pc;
+static handler_t fast_pop;
+static handler_t fast_loadw;
+static handler_t fast_loadi;
+static handler_t fast_in;
+static handler_t fast_out;
+static handler_t fast_add;
+static handler_t fast_addi;
+static handler_t fast_sub;
+static handler_t fast_subi;
+static handler_t fast_mul;
+static handler_t fast_div;
+static handler_t fast_and;
+static handler_t fast_or;
+static handler_t fast_nor;
+static handler_t fast_notb;
+static handler_t fast_sal;
+static handler_t fast_sar;
+static handler_t fast_equ;
+static handler_t fast_lt;
+static handler_t fast_lte;
+static handler_t do_lt_cjmp;
+static handler_t do_lte_cjmp;
+static handler_t do_equ_cjmp;
+static handler_t do_equ_notc_cjmp;
+static handler_t do_addi_lt_cjmp;
+    
+static uint64_t now_ms() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Writes out what OUT has buffered.
+static void flush_output(VM *vm) {
+  fflush(vm->out);
+  vm->out_pending = false;
+  vm->last_flush = now_ms();
+}
+
+// This table maps instruction code to corresponding simulation function.
+static handler_t *g_func_map[] = {do_hlt, do_jmp, do_cjmp, do_ojmp, do_call,    //4
+                                do_ret, do_push, do_pop, do_loadb, do_loadw,  //9
+                                do_storeb, do_storew, do_loadi, do_nop, do_in,//14
+                                do_out, do_add, do_addi, do_sub, do_subi,     //19
+                                do_mul, do_div, do_and, do_or, do_nor,        //24
+                                do_notb, do_sal, do_sar, do_equ, do_lt,       //29
+                                do_lte, do_notc};                             //31
+
+// Instructions verify_instr() accepts run without the checks it did, the
+// handlers of the others check them first.
+static handler_t *g_fast_map[] = {do_hlt, do_jmp, do_cjmp, do_ojmp, do_call,
+                                  do_ret, do_push, fast_pop, do_loadb,
+                                  fast_loadw, do_storeb, do_storew, fast_loadi,
+                                  do_nop, fast_in, fast_out, fast_add,
+                                  fast_addi, fast_sub, fast_subi, fast_mul,
+                                  fast_div, fast_and, fast_or, fast_nor,
+                                  fast_notb, fast_sal, fast_sar, fast_equ,
+                                  fast_lt, fast_lte, do_notc};
+
+#define CHECK_REG0(name)                             \
+  static int do_##name(VM *vm, const Instr *instr) { \
+    if (REG0() == 0) return -1;                      \
+    return fast_##name(vm, instr);                   \
+  }
+
+// Also checks that REG1(), and REG2() when there are two, exist. REG0() is
+// only checked if the instruction writes it.
+#define CHECK_REGS(name, reads, writes)                  \
+  static int do_##name(VM *vm, const Instr *instr) {     \
+    if (REG1() > 7 || (2 == (reads) && REG2() > 7)) {    \
+      vm->error = "Invalid register!";                   \
+      return -1;                                         \
+    }                                                    \
+    if ((writes) && REG0() == 0) return -1;              \
+    return fast_##name(vm, instr);                       \
+  }
+
+static int do_hlt(VM *vm, const Instr *instr) {
+  vm->stopped = true;
+  return 0;
+}
+
+static int do_jmp(VM *vm, const Instr *instr) {
+  vm->PC = ADDR() - 4;
+  return 0;
+}
+
+static int do_cjmp(VM *vm, const Instr *instr) {
+  if (vm->PSW.CF)
+    vm->PC = ADDR() - 4;
+  return 0;
+}
+
+static int do_ojmp(VM *vm, const Instr *instr) {
+  if (get_of(vm))
+    vm->PC = ADDR() - 4;
+  return 0;
+}
+
+// With guard pages, a full ES faults like a full SS.
+static int do_call(VM *vm, const Instr *instr) {
+  Frame *frame = (Frame *)(vm->ES + vm->ES_TOP);
+
+#ifndef HAVE_GUARD_PAGES
+  if (vm->ES_TOP + sizeof(Frame) > vm->es_size) {
+    vm->error = "Extended-Stack overflow!";
+    return -1;
+  }
+#endif
+  memcpy(frame->general_regs, vm->general_regs, 16);
+  frame->PC = vm->PC;
+  frame->PSW = get_of(vm) | vm->PSW.CF << 1;
+  vm->ES_TOP += sizeof(Frame);
+  vm->PC = ADDR() - 4;
+  return 0;
+}
+
+static int do_ret(VM *vm, const Instr *instr) {
+  const Frame *frame;
+
+  if (vm->ES_TOP < sizeof(Frame)) {
+    // The outter most RET. Program exits normally.
+    vm->stopped = true;
+    return 0;
+  }
+  vm->ES_TOP -= sizeof(Frame);
+  frame = (const Frame *)(vm->ES + vm->ES_TOP);
+  memcpy(vm->general_regs, frame->general_regs, 16);
+  vm->PC = frame->PC;
+  set_of(vm, frame->PSW & 1);
+  vm->PSW.CF = frame->PSW >> 1 & 1;
+  return 0;
+}
+
+// With guard pages, pushing to a full stack or popping from an empty one
+// faults, and needs no check here.
+static int do_push(VM *vm, const Instr *instr) {
+#ifndef HAVE_GUARD_PAGES
+  if (vm->SS_TOP + 2 > vm->ss_size) {
+    vm->error = "Stack overflow!";
+    return -1;
+  }
+#endif
+  *(int16_t *)(vm->SS+vm->SS_TOP) = REG0_VAL;
+  vm->SS_TOP += 2;
+  return 0;
+}
+
+static int fast_pop(VM *vm, const Instr *instr) {
+#ifndef HAVE_GUARD_PAGES
+  if (vm->SS_TOP < 2) {
+    vm->error = "Stack underflow!";
+    return -1;
+  }
+#endif
+  vm->SS_TOP -= 2;
+  REG0_VAL = *(int16_t *)(vm->SS + (int32_t)vm->SS_TOP);
+  return 0;
+}
+
+CHECK_REG0(pop)
+
+static int do_loadb(VM *vm, const Instr *instr) {
+  REG0_VAL = vm->DS[(int32_t)ADDR() + REGG_VAL];
+  return 0;
+}
+
+static int fast_loadw(VM *vm, const Instr *instr) {
+  REG0_VAL = *(int16_t *)(vm->DS + (int32_t)ADDR() + REGG_VAL*2);
+  return 0;
+}
+
+CHECK_REG0(loadw)
+
+static int do_storeb(VM *vm, const Instr *instr) {
+  vm->DS[(int32_t)ADDR() + REGG_VAL] =  vm->general_regs[REG0()];
+  return 0;
+}
+
+static int do_storew(VM *vm, const Instr *instr) {
+  *(int16_t *)(vm->DS + (int32_t)ADDR() + REGG_VAL*2) = REG0_VAL;
+  return 0;
+}
+
+static int fast_loadi(VM *vm, const Instr *instr) {
+  REG0_VAL = IMMEDIATE();
+  return 0;
+}
+
+CHECK_REG0(loadi)
+
+static int do_nop(VM *vm, const Instr *instr) {
+  return 0;
+}
+
+static int fast_in(VM *vm, const Instr *instr) {
+  // Show the prompt before waiting for the answer.
+  if (vm->out_pending) flush_output(vm);
+  if (!vm->feeding) {
+    REG0_VAL = getc(vm->in);
+  } else if (vm->feed_pos < vm->feed_size) {
+    REG0_VAL = vm->feed[vm->feed_pos++];
+  } else if (vm->fed_all) {
+    REG0_VAL = EOF;
+  } else {
+    vm->trap = TRAP_INPUT; // Not an error, see vm_run().
+    return -1;
+  }
+  return 0;
+}
+
+static int do_in(VM *vm, const Instr *instr) {
+  if (REG0() == 0) return -1;
+  if (PORT() != 0) {
+    vm->error = "Invalid input port!";
+    return -1;
+  }
+  return fast_in(vm, instr);
+}
+
+static int fast_out(VM *vm, const Instr *instr) {
+  putc(REG0_VAL, vm->out);
+  if (0 == vm->flush_interval)
+    fflush(vm->out);
+  else
+    vm->out_pending = true;
+  return 0;
+}
+
+static int do_out(VM *vm, const Instr *instr) {
+  if (PORT() != 15) {
+    vm->error = "Invalid output port!";
+    return -1;
+  }
+  return fast_out(vm, instr);
+}
+
+// IN and OUT of steps run again after going back in time. IN reads what it
+// read the first time, and OUT doesn't write again.
+static int do_replayed_in(VM *vm, const Instr *instr) {
+  if (REG0() == 0) return -1;
+  if (PORT() != 0) {
+    vm->error = "Invalid input port!";
+    return -1;
+  }
+  REG0_VAL = vm->history->inputs[vm->history->in_pos++];
+  return 0;
+}
+
+static int do_replayed_out(VM *vm, const Instr *instr) {
+  if (PORT() != 15) {
+    vm->error = "Invalid output port!";
+    return -1;
+  }
+  return 0;
+}
+
+// OF is only worked out when OJMP, CALL or vm_psw() reads it.
+static inline void keep_result(VM *vm, int32_t result) {
+  vm->PSW.result = result;
+}
+
+static int fast_add(VM *vm, const Instr *instr) {
+  int32_t result = REG1_VAL + REG2_VAL;
+  keep_result(vm, result);
+  REG0_VAL = result;  
+  return 0;
+}
+
+CHECK_REGS(add, 2, true)
+
+static int fast_addi(VM *vm, const Instr *instr) {
+  int32_t result = REG0_VAL + IMMEDIATE();
+  keep_result(vm, result);
+  REG0_VAL = result;  
+  return 0;
+}
+
+CHECK_REG0(addi)
+
+static int fast_sub(VM *vm, const Instr *instr) {
+  int32_t result = REG1_VAL - REG2_VAL;
+  keep_result(vm, result);
+  REG0_VAL = result;  
+  return 0;
+}
+
+CHECK_REGS(sub, 2, true)
+
+static int fast_subi(VM *vm, const Instr *instr) {
+  int32_t result = REG0_VAL - IMMEDIATE();
+  keep_result(vm, result);
+  REG0_VAL = result;  
+  return 0;
+}
+
+CHECK_REG0(subi)
+
+static int fast_mul(VM *vm, const Instr *instr) {
+  int32_t result = REG1_VAL * REG2_VAL;
+  keep_result(vm, result);
+  REG0_VAL = result;  
+  return 0;
+}
+
+CHECK_REGS(mul, 2, true)
+
+static int fast_div(VM *vm, const Instr *instr) {
+  if (REG2_VAL == 0) {
+    vm->error = "0-div!";
+    return -1;
+  }
+  int32_t result = REG1_VAL / REG2_VAL;
+  keep_result(vm, result);
+  REG0_VAL = result;  
+  return 0;
+}
+
+CHECK_REGS(div, 2, true)
+
+static int fast_and(VM *vm, const Instr *instr) {
+  REG0_VAL = REG1_VAL & REG2_VAL;
+  return 0;
+}
+
+CHECK_REGS(and, 2, true)
+
+static int fast_or(VM *vm, const Instr *instr) {
+  REG0_VAL = REG1_VAL | REG2_VAL;
+  return 0;
+}
+
+CHECK_REGS(or, 2, true)
+
+static int fast_nor(VM *vm, const Instr *instr) {
+  REG0_VAL = REG1_VAL ^ REG2_VAL;
+  return 0;
+}
+
+CHECK_REGS(nor, 2, true)
+
+static int fast_notb(VM *vm, const Instr *instr) {
+  REG0_VAL = ~REG1_VAL;
+  return 0;
+}
+
+CHECK_REGS(notb, 1, true)
+
+static int fast_sal(VM *vm, const Instr *instr) {
+  REG0_VAL = REG1_VAL << REG2_VAL;
+  return 0;
+}
+
+CHECK_REGS(sal, 2, true)
+
+static int fast_sar(VM *vm, const Instr *instr) {
+  uint16_t result = REG1_VAL;
+  for (int i = 0; i < REG2_VAL && i < 16; ++i) {
+    result >>= 1;
+    result |= (result << 1) & 0x8000;
+  }
+  REG0_VAL = result;
+  return 0;
+}
+
+CHECK_REGS(sar, 2, true)
+
+static int fast_equ(VM *vm, const Instr *instr) {
+  if (REG0_VAL == REG1_VAL)
+    vm->PSW.CF = 1;
+  else
+    vm->PSW.CF = 0;
+  return 0;
+}
+
+CHECK_REGS(equ, 1, false)
+
+static int fast_lt(VM *vm, const Instr *instr) {
+  if (REG0_VAL < REG1_VAL)
+    vm->PSW.CF = 1;
+  else
+    vm->PSW.CF = 0;
+  return 0;
+}
+
+CHECK_REGS(lt, 1, false)
+
+static int fast_lte(VM *vm, const Instr *instr) {
+  if (REG0_VAL <= REG1_VAL)
+    vm->PSW.CF = 1;
+  else
+    vm->PSW.CF = 0;
+  return 0;
+}
+
+CHECK_REGS(lte, 1, false)
+
+#undef CHECK_REG0
+#undef CHECK_REGS
+
+static int do_notc(VM *vm, const Instr *instr) {
+  vm->PSW.CF = !vm->PSW.CF;
+  return 0;
+}
+
+// Sits right after the last instruction, and is also the destination of
+// jumps that don't land on an instruction.
+static int do_bad_pc(VM *vm, const Instr *instr) {
+  vm->error = "PC out of code segment!";
+  return -1;
+}
+
+int do_break(VM *vm, const Instr *instr) {
+  vm->trap = TRAP_BREAK;
+  return -1;
+}
+
+// Superinstructions. Each one runs a whole sequence of instructions starting
+// at instr, and leaves PC at the last one, exactly like stepping through them
+// would. The instructions after the first keep their own handlers, so jumping
+// into the middle of a sequence still works.
+static int do_lt_cjmp(VM *vm, const Instr *instr) {
+  fast_lt(vm, instr);
+  vm->PC += 4;
+  return do_cjmp(vm, instr + 1);
+}
+
+static int do_lte_cjmp(VM *vm, const Instr *instr) {
+  fast_lte(vm, instr);
+  vm->PC += 4;
+  return do_cjmp(vm, instr + 1);
+}
+
+static int do_equ_cjmp(VM *vm, const Instr *instr) {
+  fast_equ(vm, instr);
+  vm->PC += 4;
+  return do_cjmp(vm, instr + 1);
+}
+
+static int do_equ_notc_cjmp(VM *vm, const Instr *instr) {
+  fast_equ(vm, instr);
+  do_notc(vm, instr + 1);
+  vm->PC += 8;
+  return do_cjmp(vm, instr + 2);
+}
+
+// Superinstructions are only fused when verify_instr() accepts what they run
+// without the checks.
+static int do_addi_lt_cjmp(VM *vm, const Instr *instr) {
+  fast_addi(vm, instr);
+  fast_lt(vm, instr + 1);
+  vm->PC += 8;
+  return do_cjmp(vm, instr + 2);
+}
+
+int instr_length(Opcode opcode) {
+  switch (opcode) {
+    case OP_LT_CJMP: case OP_LTE_CJMP: case OP_EQU_CJMP:
+      return 2;
+    case OP_EQU_NOTC_CJMP: case OP_ADDI_LT_CJMP:
+      return 3;
+    default:
+      return 1;
+  }
+}
+
+bool is_block_end(Opcode opcode) {
+  switch (opcode) {
+    case OP_HLT: case OP_JMP: case OP_CJMP: case OP_OJMP: case OP_CALL:
+    case OP_RET: case OP_LT_CJMP: case OP_LTE_CJMP: case OP_EQU_CJMP:
+    case OP_EQU_NOTC_CJMP: case OP_ADDI_LT_CJMP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+Opcode base_opcode(Opcode opcode) {
+  switch (opcode) {
+    case OP_LT_CJMP: return OP_LT;
+    case OP_LTE_CJMP: return OP_LTE;
+    case OP_EQU_CJMP: case OP_EQU_NOTC_CJMP: return OP_EQU;
+    case OP_ADDI_LT_CJMP: return OP_ADDI;
+    default: return opcode;
+  }
+}
+
+// Checks what a decoded instruction can be checked for without running it.
+// Returns what's wrong with it, or NULL.
+static const char *verify_instr(VM *vm, const Instr *instr) {
+  Opcode opcode = base_opcode(instr->opcode);
+
+  switch (opcode) {
+    case OP_JMP: case OP_CJMP: case OP_OJMP: case OP_CALL:
+      // decode_instr() sent the ones that don't land on an instruction there.
+      if (instr->addr == vm->CS_SIZE) return "Jump target out of code segment!";
+      return NULL;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_AND:
+    case OP_OR: case OP_NOR: case OP_SAL: case OP_SAR:
+      if (instr->reg2 > 7) return "Invalid register!";
+      // Fall through.
+    case OP_NOTB:
+      if (instr->reg1 > 7) return "Invalid register!";
+      break;
+    case OP_EQU: case OP_LT: case OP_LTE:
+      // Compares only set CF, so they may read Z.
+      if (instr->reg1 > 7) return "Invalid register!";
+      return NULL;
+    case OP_IN:
+      if (instr->port != 0) return "Invalid input port!";
+      break;
+    case OP_OUT:
+      if (instr->port != 15) return "Invalid output port!";
+      return NULL;
+    default:
+      break;
+  }
+  if (g_fast_map[opcode] != g_func_map[opcode] && instr->reg0 == 0)
+    return "Writes to register Z!";
+  return NULL;
+}
+
+// The handler decode_instr() and fuse_cs() give to instr.
+static handler_t *handler_of(VM *vm, const Instr *instr) {
+  switch (instr->opcode) {
+    case OP_LT_CJMP: return do_lt_cjmp;
+    case OP_LTE_CJMP: return do_lte_cjmp;
+    case OP_EQU_CJMP: return do_equ_cjmp;
+    case OP_EQU_NOTC_CJMP: return do_equ_notc_cjmp;
+    case OP_ADDI_LT_CJMP: return do_addi_lt_cjmp;
+    default:
+      return verify_instr(vm, instr) ? g_func_map[instr->opcode]
+                                     : g_fast_map[instr->opcode];
+  }
+}
+
+// Whether instr runs a handler checking what verify_instr() didn't accept.
+static bool checked(const Instr *instr) {
+  return instr->opcode < 32 && instr->handler == g_func_map[instr->opcode] &&
+         instr->handler != g_fast_map[instr->opcode];
+}
+
+// Decodes a raw instruction code.
+static void decode_instr(VM *vm, uint32_t code, Instr *instr) {
+  memset(instr, 0, sizeof(Instr));
+  instr->opcode = CODE_OPCODE(code);
+  instr->reg0 = CODE_REG0(code);
+  instr->reg1 = CODE_REG1(code);
+  instr->reg2 = CODE_REG2(code);
+
+  switch (instr->opcode) {
+    case OP_JMP: case OP_CJMP: case OP_OJMP: case OP_CALL:
+      instr->addr = CODE_ADDR(code);
+      // Jumps that don't land on an instruction go to the sentinel.
+      if (instr->addr % 4 || instr->addr >= vm->CS_SIZE)
+        instr->addr = vm->CS_SIZE;
+      break;
+    case OP_LOADB: case OP_LOADW: case OP_STOREB: case OP_STOREW:
+      instr->addr = CODE_ADDR(code);
+      break;
+    case OP_LOADI: case OP_ADDI: case OP_SUBI:
+      instr->immediate = CODE_IMMEDIATE(code);
+      break;
+    case OP_IN: case OP_OUT:
+      instr->port = CODE_PORT(code);
+      break;
+    default:
+      break;
+  }
+  instr->handler = handler_of(vm, instr);
+}
+
+// Decodes the whole code segment.
+static int decode_cs(VM *vm) {
+  uint32_t n = vm->CS_SIZE / 4;
+
+  vm->code = malloc((n + 1) * sizeof(Instr));
+  if (!vm->code) return -1;
+  for (uint32_t i = 0; i < n; ++i)
+    decode_instr(vm, *(uint32_t *)(vm->CS + i*4), &vm->code[i]);
+
+  memset(&vm->code[n], 0, sizeof(Instr));
+  vm->code[n].handler = do_bad_pc;
+  return 0;
+}
+
+// Replaces common instruction sequences with superinstructions.
+// Only the first instruction of a sequence is replaced.
+static void fuse_cs(VM *vm) {
+  Instr *code = vm->code;
+  uint32_t n = vm->CS_SIZE / 4;
+
+  // Scanning forward, so the instructions after i still have their
+  // original opcodes.
+  for (uint32_t i = 0; i + 1 < n; ++i) {
+    Opcode op1 = code[i+1].opcode;
+    Opcode op2 = i + 2 < n ? code[i+2].opcode : OP_HLT;
+
+    // The ones verify_instr() didn't accept keep their checks.
+    if (verify_instr(vm, &code[i])) continue;
+    switch (code[i].opcode) {
+      case OP_ADDI:
+        if (op1 == OP_LT && op2 == OP_CJMP && !verify_instr(vm, &code[i+1])) {
+          code[i].opcode = OP_ADDI_LT_CJMP;
+          code[i].handler = do_addi_lt_cjmp;
+        }
+        break;
+      case OP_EQU:
+        if (op1 == OP_NOTC && op2 == OP_CJMP) {
+          code[i].opcode = OP_EQU_NOTC_CJMP;
+          code[i].handler = do_equ_notc_cjmp;
+        } else if (op1 == OP_CJMP) {
+          code[i].opcode = OP_EQU_CJMP;
+          code[i].handler = do_equ_cjmp;
+        }
+        break;
+      case OP_LT:
+        if (op1 == OP_CJMP) {
+          code[i].opcode = OP_LT_CJMP;
+          code[i].handler = do_lt_cjmp;
+        }
+        break;
+      case OP_LTE:
+        if (op1 == OP_CJMP) {
+          code[i].opcode = OP_LTE_CJMP;
+          code[i].handler = do_lte_cjmp;
+        }
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+// Releases the loaded program and everything derived from it.
+static void unload(VM *vm) {
+#ifdef HAVE_JIT_ENGINE
+  jit_destroy(vm);
+#endif
+#ifdef HAVE_GUARD_PAGES
+  guard_release(vm);
+  free(vm->CS);
+#else
+  free(vm->DS);
+  free(vm->CS);
+  free(vm->SS);
+  free(vm->ES);
+#endif
+  free(vm->code);
+  free(vm->run_len);
+  free(vm->thread);
+  free(vm->watches);
+  free(vm->feed);
+  vm->feed = NULL;
+  vm->feed_pos = vm->feed_size = vm->feed_cap = 0;
+  vm->fed_all = false;
+  profile_destroy(vm->profile);
+  vm->profile = NULL;
+  counters_destroy(vm->counters);
+  vm->counters = NULL;
+  trace_destroy(vm->trace);
+  vm->trace = NULL;
+  history_destroy(vm->history);
+  vm->history = NULL;
+  vm->DS = vm->CS = vm->SS = vm->ES = NULL;
+  vm->code = NULL;
+  vm->run_len = NULL;
+  vm->thread = NULL;
+  vm->watches = NULL;
+  vm->watch_num = 0;
+}
+
+// Loads the image, returns the error message or NULL.
+static const char *load_image(VM *vm, const char *file_name) {
+  uint32_t ds_size, cs_size;
+  FILE *fp;
+
+  fp = fopen(file_name, "rb");
+  if (!fp) return "Can't open input file!";
+  if (1 != fread(&ds_size, 4, 1, fp) || 1 != fread(&cs_size, 4, 1, fp))
+    goto corrupted;
+
+  // Load code and data. Both are copied instead of mapped from the file:
+  // sas rewrites images in place, which would change DS under a running
+  // program, or kill it with SIGBUS once the file is truncated, and
+  // decode_cs() copies CS into the decoded instructions anyway.
+#ifdef HAVE_GUARD_PAGES
+  if (0 != guard_reserve(vm, ds_size)) goto no_memory;
+  vm->DS = guard_data(vm, ds_size);
+#else
+  vm->DS = malloc(ds_size);
+#endif
+  if (!vm->DS) goto no_memory;
+  if (1 != fread(vm->DS, ds_size, 1, fp))
+    goto corrupted;
+
+  vm->CS = malloc(cs_size);
+  if (!vm->CS) goto no_memory;
+  if (1 != fread(vm->CS, cs_size, 1, fp))
+    goto corrupted;
+  vm->CS_SIZE = cs_size & ~(uint32_t)3; // Ignore trailing bytes.
+  vm->DS_SIZE = ds_size;
+  fclose(fp);
+  return NULL;
+
+corrupted:
+  fclose(fp);
+  return "Input file corrupted!";
+no_memory:
+  fclose(fp);
+  return "Out of memory!";
+}
+
+// Works out how many instructions there are from every one to the end of its
+// straight-line run, the sentinel ends the last one.
+static uint32_t *count_runs(VM *vm) {
+  uint32_t n = vm->CS_SIZE / 4;
+  uint32_t *run_len = malloc((n + 1) * sizeof(uint32_t));
+
+  if (!run_len) return NULL;
+  run_len[n] = 1;
+  for (uint32_t i = n; i-- > 0; )
+    run_len[i] = is_block_end(vm->code[i].opcode) ? 1 : run_len[i + 1] + 1;
+  return run_len;
+}
+
+// Steps from the instruction at index i to the end of its straight-line run.
+static uint64_t run_steps(const VM *vm, uint32_t i) {
+  uint32_t last = i + vm->run_len[i] - 1;
+
+  return last - i + instr_length(vm->code[last].opcode);
+}
+
+// Runs the program by calling through the handlers of the decoded instructions.
+// Steps are counted, and the limit checked, once per straight-line run: its
+// steps are added up front, and the ones from PC on taken off again if an
+// instruction fails, see run_engine(). The run the limit falls in goes one
+// instruction at a time, so it stops right at the limit.
+// Returns non-zero on execution error, with PC pointing at the failed instruction.
+static int run_call(VM *vm, uint64_t limit) {
+  const Instr *code = vm->code, *instr;
+  uint64_t steps;
+
+  if (!vm->run_len && !(vm->run_len = count_runs(vm))) {
+    vm->error = "Out of memory!";
+    return -1;
+  }
+  while (!vm->stopped && vm->steps < limit) {
+    steps = run_steps(vm, vm->PC / 4);
+    if (limit - vm->steps >= steps) {
+      vm->steps += steps;
+      for (uint32_t k = vm->run_len[vm->PC / 4]; k; --k) {
+        instr = &code[vm->PC / 4];
+        if (0 != instr->handler(vm, instr)) return -1;
+        vm->PC += 4;
+      }
+    } else {
+      instr = &code[vm->PC / 4];
+      vm->steps += steps;
+      if (0 != instr->handler(vm, instr)) return -1;
+      vm->steps -= steps - instr_length(instr->opcode);
+      vm->PC += 4;
+    }
+  }
+  if (vm->stopped) vm->PC -= 4; // Stay at the instruction that stopped it.
+  return 0;
+}
+
+#ifdef HAVE_THREADED_ENGINE
+// Runs the program with direct-threaded code: every instruction has the
+// address of its label, and every label jumps straight to the next one.
+// Straight-line instructions reuse the do_* handlers, which get inlined.
+// Control transfers work on the instruction index directly, PC is only
+// kept up to date where it can be observed. Steps are counted, and the limit
+// checked, only at control transfers.
+// Returns non-zero on execution error, with PC pointing at the failed instruction.
+static int run_threaded(VM *vm, uint64_t limit) {
+  static void *labels[] = {
+    &&op_hlt, &&op_jmp, &&op_cjmp, &&op_ojmp, &&op_call,
+    &&op_ret, &&op_push, &&op_pop, &&op_loadb, &&op_loadw,
+    &&op_storeb, &&op_storew, &&op_loadi, &&op_nop, &&op_in,
+    &&op_out, &&op_add, &&op_addi, &&op_sub, &&op_subi,
+    &&op_mul, &&op_div, &&op_and, &&op_or, &&op_nor,
+    &&op_notb, &&op_sal, &&op_sar, &&op_equ, &&op_lt,
+    &&op_lte, &&op_notc,
+    &&op_lt_cjmp, &&op_lte_cjmp, &&op_equ_cjmp, &&op_equ_notc_cjmp,
+    &&op_addi_lt_cjmp};
+  const Instr *code = vm->code;
+  uint32_t n = vm->CS_SIZE / 4;
+  uint32_t i = vm->PC / 4;
+  uint32_t start = i; // Where the current straight-line run started.
+  uint64_t steps = vm->steps;
+  void **thread = vm->thread;
+  int ret = 0;
+
+  if (!thread) {
+    thread = malloc((n + 1) * sizeof(void *));
+    if (!thread) {
+      vm->error = "Out of memory!";
+      return -1;
+    }
+    for (uint32_t k = 0; k < n; ++k) {
+      if (do_break == code[k].handler)
+        thread[k] = &&op_break;
+      else if (checked(&code[k]))
+        thread[k] = &&op_checked;
+      else
+        thread[k] = labels[code[k].opcode];
+    }
+    thread[n] = &&op_bad_pc;
+    vm->thread = thread;
+  }
+
+#define DISPATCH() goto *thread[i]
+// Straight-line instructions run the handler without the checks, see
+// verify_instr().
+#define SIMPLE_OP(name, handler)                      \
+  op_##name:                                          \
+    if (0 != handler(vm, &code[i])) goto fail;        \
+    ++i;                                              \
+    DISPATCH();
+// Memory accesses may fault, and the fault handler reports PC and steps.
+#define MEMORY_OP(name, handler)                      \
+  op_##name:                                          \
+    vm->PC = i * 4;                                   \
+    vm->steps = steps + i - start;                    \
+    if (0 != handler(vm, &code[i])) goto fail;        \
+    ++i;                                              \
+    DISPATCH();
+// Ends the straight-line run with the len instructions at i, and goes on at
+// next.
+#define BRANCH(len, next)                             \
+  do {                                                \
+    steps += i + (len) - start;                       \
+    i = start = (next);                               \
+    if (steps >= limit) goto done;                    \
+    DISPATCH();                                       \
+  } while (0)
+
+  DISPATCH();
+
+  MEMORY_OP(push, do_push)
+  MEMORY_OP(pop, fast_pop)
+  MEMORY_OP(loadb, do_loadb)
+  MEMORY_OP(loadw, fast_loadw)
+  MEMORY_OP(storeb, do_storeb)
+  MEMORY_OP(storew, do_storew)
+  SIMPLE_OP(loadi, fast_loadi)
+  SIMPLE_OP(nop, do_nop)
+  SIMPLE_OP(in, fast_in)
+  SIMPLE_OP(out, fast_out)
+  SIMPLE_OP(add, fast_add)
+  SIMPLE_OP(addi, fast_addi)
+  SIMPLE_OP(sub, fast_sub)
+  SIMPLE_OP(subi, fast_subi)
+  SIMPLE_OP(mul, fast_mul)
+  SIMPLE_OP(div, fast_div)
+  SIMPLE_OP(and, fast_and)
+  SIMPLE_OP(or, fast_or)
+  SIMPLE_OP(nor, fast_nor)
+  SIMPLE_OP(notb, fast_notb)
+  SIMPLE_OP(sal, fast_sal)
+  SIMPLE_OP(sar, fast_sar)
+  SIMPLE_OP(equ, fast_equ)
+  SIMPLE_OP(lt, fast_lt)
+  SIMPLE_OP(lte, fast_lte)
+  SIMPLE_OP(notc, do_notc)
+
+op_jmp:
+  BRANCH(1, code[i].addr / 4);
+
+op_cjmp:
+  BRANCH(1, vm->PSW.CF ? code[i].addr / 4 : i + 1);
+
+op_ojmp:
+  BRANCH(1, get_of(vm) ? code[i].addr / 4 : i + 1);
+
+op_call:
+  vm->PC = i * 4;
+  vm->steps = steps + i - start; // A full ES faults.
+  if (0 != do_call(vm, &code[i])) goto fail;
+  BRANCH(1, code[i].addr / 4); // PC wrapped around for CALL 0.
+
+op_ret:
+  vm->PC = i * 4;
+  if (0 != do_ret(vm, &code[i])) goto fail;
+  if (vm->stopped) goto stop;
+  BRANCH(1, vm->PC / 4 + 1);
+
+op_lt_cjmp:
+  fast_lt(vm, &code[i]);
+  BRANCH(2, vm->PSW.CF ? code[i+1].addr / 4 : i + 2);
+
+op_lte_cjmp:
+  fast_lte(vm, &code[i]);
+  BRANCH(2, vm->PSW.CF ? code[i+1].addr / 4 : i + 2);
+
+op_equ_cjmp:
+  fast_equ(vm, &code[i]);
+  BRANCH(2, vm->PSW.CF ? code[i+1].addr / 4 : i + 2);
+
+op_equ_notc_cjmp:
+  fast_equ(vm, &code[i]);
+  do_notc(vm, &code[i+1]);
+  BRANCH(3, vm->PSW.CF ? code[i+2].addr / 4 : i + 3);
+
+op_addi_lt_cjmp:
+  fast_addi(vm, &code[i]);
+  fast_lt(vm, &code[i+1]);
+  BRANCH(3, vm->PSW.CF ? code[i+2].addr / 4 : i + 3);
+
+op_hlt:
+  do_hlt(vm, &code[i]);
+  goto stop;
+
+op_bad_pc:
+  do_bad_pc(vm, &code[i]);
+  goto fail;
+
+op_break:
+  do_break(vm, &code[i]);
+  goto fail;
+
+// The ones verify_instr() didn't accept, with their checking handlers.
+op_checked:
+  vm->PC = i * 4;
+  vm->steps = steps + i - start;
+  if (0 != code[i].handler(vm, &code[i])) goto fail;
+  ++i;
+  DISPATCH();
+
+#undef BRANCH
+#undef MEMORY_OP
+#undef SIMPLE_OP
+#undef DISPATCH
+
+stop:
+  steps += i + 1 - start;
+  goto done;
+fail:
+  steps += i - start;
+  ret = -1;
+done:
+  vm->PC = i * 4;
+  vm->steps = steps;
+  return ret;
+}
+#endif
+
+VM *vm_create() {
+  VM *vm = aligned_alloc(CACHE_LINE_SIZE, sizeof(VM));
+
+  if (!vm) return NULL;
+  memset(vm, 0, sizeof(VM));
+  vm->in = stdin;
+  vm->out = stdout;
+  vm->flush_interval = 100;
+  vm->engine = VM_ENGINE_CALL;
+  vm->fuse = true;
+  vm->ss_size = STACK_SIZE;
+  vm->es_size = ES_SIZE;
+  return vm;
+}
+
+int vm_set_engine(VM *vm, VMEngine engine) {
+  switch (engine) {
+#ifdef HAVE_THREADED_ENGINE
+    case VM_ENGINE_THREADED:
+#endif
+#ifdef HAVE_JIT_ENGINE
+    case VM_ENGINE_JIT:
+#endif
+    case VM_ENGINE_CALL:
+      vm->engine = engine;
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+void vm_set_fuse(VM *vm, bool fuse) {
+  vm->fuse = fuse;
+}
+
+int vm_set_stack_sizes(VM *vm, size_t ss_size, size_t es_size) {
+  if (ss_size > MAX_STACK_SIZE || es_size > MAX_STACK_SIZE) return -1;
+  if (ss_size) vm->ss_size = ss_size;
+  if (es_size) vm->es_size = es_size;
+  return 0;
+}
+
+void vm_set_io(VM *vm, FILE *in, FILE *out) {
+  if (vm->out_pending) flush_output(vm);
+  vm->in = in;
+  vm->out = out;
+}
+
+void vm_set_feed(VM *vm, bool on) {
+  vm->feeding = on;
+}
+
+int vm_feed(VM *vm, const void *buf, size_t size) {
+  uint8_t *feed;
+  size_t cap;
+
+  if (!size) {
+    vm->fed_all = true;
+    return 0;
+  }
+  // Drop what IN already read, then make room.
+  if (vm->feed_pos) {
+    memmove(vm->feed, vm->feed + vm->feed_pos, vm->feed_size - vm->feed_pos);
+    vm->feed_size -= vm->feed_pos;
+    vm->feed_pos = 0;
+  }
+  if (vm->feed_size + size > vm->feed_cap) {
+    cap = vm->feed_cap ? vm->feed_cap : 256;
+    while (cap < vm->feed_size + size) cap *= 2;
+    feed = realloc(vm->feed, cap);
+    if (!feed) return -1;
+    vm->feed = feed;
+    vm->feed_cap = cap;
+  }
+  memcpy(vm->feed + vm->feed_size, buf, size);
+  vm->feed_size += size;
+  return 0;
+}
+
+void vm_set_flush_interval(VM *vm, int ms) {
+  vm->flush_interval = ms;
+}
+
+int vm_load(VM *vm, const char *file_name) {
+  VM config = *vm;
+
+  if (vm->out_pending) flush_output(vm);
+  // Start over, keeping the configuration.
+  unload(vm);
+  memset(vm, 0, sizeof(VM));
+  vm->in = config.in;
+  vm->out = config.out;
+  vm->flush_interval = config.flush_interval;
+  vm->feeding = config.feeding;
+  vm->last_flush = now_ms();
+  vm->engine = config.engine;
+  vm->fuse = config.fuse;
+  vm->ss_size = config.ss_size;
+  vm->es_size = config.es_size;
+  vm->profiling = config.profiling;
+  vm->counting = config.counting;
+  vm->trace_size = config.trace_size;
+  vm->history_size = config.history_size;
+
+  vm->error = load_image(vm, file_name);
+  if (!vm->error && 0 != decode_cs(vm))
+    vm->error = "Out of memory!";
+  if (vm->error) goto fail;
+  // Instructions were already decoded.
+  if (vm->fuse) fuse_cs(vm);
+
+  // Allocate stack and extended segment, guard_reserve() mapped them.
+#ifndef HAVE_GUARD_PAGES
+  vm->SS = malloc(vm->ss_size);
+  vm->ES = malloc(vm->es_size);
+#endif
+  if (!vm->SS || !vm->ES) {
+    vm->error = "Out of memory!";
+    goto fail;
+  }
+
+  vm->error = snapshot_restore(vm, file_name);
+  if (vm->error) goto fail;
+  return 0;
+
+fail:
+  unload(vm);
+  vm->failed = true;
+  return -1;
+}
+
+int vm_verify(VM *vm, FILE *fp) {
+  const char *problem;
+  int num = 0;
+
+  if (!vm->code) return 0;
+  for (uint32_t k = 0; k < vm->CS_SIZE / 4; ++k) {
+    problem = verify_instr(vm, &vm->code[k]);
+    if (!problem) continue;
+    fprintf(fp, "PC: %u %s\n", k * 4, problem);
+    ++num;
+  }
+  return num;
+}
+
+static VMStatus status(VM *vm) {
+  if (vm->failed) return VM_ERROR;
+  if (TRAP_INPUT == vm->trap) return VM_WAITING;
+  if (TRAP_NONE != vm->trap) return VM_BREAK;
+  return vm->stopped ? VM_STOPPED : VM_RUNNING;
+}
+
+// The breakpoint or watchpoint that stops the instruction at PC, if any.
+static Trap trap_at(VM *vm) {
+  const Instr *instr = &vm->code[vm->PC / 4];
+  int32_t index;
+
+  if (do_break == instr->handler) return TRAP_BREAK;
+  if (!vm->watch_num || !watch_hit(vm, instr, &index)) return TRAP_NONE;
+  vm->watch_index = index;
+  return TRAP_WATCH;
+}
+
+// Runs exactly one instruction, superinstructions would run more than one.
+static int run_step(VM *vm, uint64_t limit) {
+  const Instr *instr = &vm->code[vm->PC / 4];
+  handler_t *handler;
+
+  handler = vm->PC < vm->CS_SIZE ? g_func_map[base_opcode(instr->opcode)]
+                                 : do_bad_pc;
+  if (0 != handler(vm, instr)) return -1;
+  ++vm->steps;
+  if (!vm->stopped) vm->PC += 4;
+  return 0;
+}
+
+// Runs the instructions one by one like run_step(), profiling, tracing and
+// recording the history of them. Steps run again after going back in time
+// aren't profiled or traced twice. Breakpoints and watchpoints are checked
+// here, since the handlers aren't called through.
+static int run_observed(VM *vm, uint64_t limit) {
+  Profile *profile = vm->profile;
+  Trace *trace = vm->trace;
+  History *history = vm->history;
+  const Instr *instr;
+  handler_t *handler;
+  Opcode opcode;
+  bool again;
+  uint32_t i;
+
+  while (!vm->stopped && vm->steps < limit) {
+    if (!vm->ignore_traps && TRAP_NONE != (vm->trap = trap_at(vm)))
+      return -1;
+    i = vm->PC / 4;
+    instr = &vm->code[i];
+    opcode = base_opcode(instr->opcode);
+    handler = vm->PC < vm->CS_SIZE ? g_func_map[opcode] : do_bad_pc;
+    again = history && vm->steps < history->high;
+    if (history) {
+      if (OP_IN == opcode && history->in_pos < history->in_num)
+        handler = do_replayed_in;
+      else if (OP_OUT == opcode && again)
+        handler = do_replayed_out;
+      if (0 != history_before(history, vm, instr)) goto no_memory;
+    }
+    if (trace && !again) trace_before(trace, vm, instr);
+    if (0 != handler(vm, instr)) return -1;
+    if (trace && !again) trace_after(trace, vm, instr);
+
+    if (profile && !again) {
+      ++profile->counts[i];
+      ++profile->opcodes[opcode];
+      // Taken even when it goes to the next instruction. Jumping leaves the
+      // flags alone.
+      if (OP_CJMP == opcode)
+        profile->taken[i] += vm->PSW.CF;
+      else if (OP_OJMP == opcode)
+        profile->taken[i] += get_of(vm);
+      else if (OP_CALL == opcode)
+        ++profile->calls[instr->addr / 4];
+    }
+
+    ++vm->steps;
+    if (!vm->stopped) vm->PC += 4;
+    if (history && 0 != history_after(history, vm, instr)) goto no_memory;
+  }
+  return 0;
+
+no_memory:
+  vm->error = "Out of memory!";
+  return -1;
+}
+
+// Runs the instructions one by one through their handlers, reading the host
+// counters after every one of them, and charging what they counted to its
+// opcode.
+static int run_counted(VM *vm, uint64_t limit) {
+  Counters *counters = vm->counters;
+  uint64_t before[COUNTER_NUM], after[COUNTER_NUM];
+  const Instr *instr;
+  handler_t *handler;
+  Opcode opcode;
+  int ret;
+
+  counters->by_opcode = true;
+  counters_read(counters, before);
+  while (!vm->stopped && vm->steps < limit) {
+    if (!vm->ignore_traps && TRAP_NONE != (vm->trap = trap_at(vm)))
+      return -1;
+    instr = &vm->code[vm->PC / 4];
+    opcode = base_opcode(instr->opcode);
+    handler = vm->PC < vm->CS_SIZE ? g_func_map[opcode] : do_bad_pc;
+    ret = handler(vm, instr);
+    counters_read(counters, after);
+    counters_charge(counters, opcode, before, after);
+    if (0 != ret) return -1;
+    memcpy(before, after, sizeof(before));
+
+    ++vm->steps;
+    if (!vm->stopped) vm->PC += 4;
+  }
+  return 0;
+}
+
+// Whether run_observed() has to be used instead of the engine.
+static bool observed(VM *vm) {
+  return vm->profiling || vm->trace_size || vm->history_size;
+}
+
+// Allocates the profile, the trace and the history if they're on and weren't
+// yet.
+static int prepare_observed(VM *vm) {
+  if (vm->counting && !vm->counters) {
+    vm->counters = counters_create();
+    if (!vm->counters) {
+      vm->error = "Can't open the host counters!";
+      return -1;
+    }
+  }
+  if (vm->profiling && !vm->profile)
+    vm->profile = profile_create(vm->CS_SIZE / 4);
+  if (vm->trace_size && !vm->trace) vm->trace = trace_create(vm->trace_size);
+  if (vm->history_size && !vm->history)
+    vm->history = history_create(vm, vm->history_size);
+  if ((vm->profiling && !vm->profile) || (vm->trace_size && !vm->trace) ||
+      (vm->history_size && !vm->history)) {
+    vm->error = "Out of memory!";
+    return -1;
+  }
+  return 0;
+}
+
+// Runs an engine, catching the faults of guest memory accesses.
+static int run_engine(VM *vm, int (*run)(VM *vm, uint64_t limit),
+                      uint64_t limit) {
+  int ret;
+
+#ifdef HAVE_GUARD_PAGES
+  ret = guard_run(vm, run, limit);
+#else
+  ret = run(vm, limit);
+#endif
+  // The call engine counted the rest of the run the instruction is in.
+  if (0 != ret && run_call == run && vm->run_len)
+    vm->steps -= run_steps(vm, vm->PC / 4);
+  return ret;
+}
+
+// Runs the instruction at PC whatever breakpoint or watchpoint is on it, so
+// a run it stopped can go on.
+static int step_over(VM *vm) {
+  int ret;
+
+  vm->ignore_traps = true;
+  ret = run_engine(vm, observed(vm) ? run_observed : run_step, vm->steps + 1);
+  vm->ignore_traps = false;
+  return ret;
+}
+
+// Stops at the breakpoint or watchpoint at PC, if any, so the next run steps
+// over it.
+static VMStatus settle(VM *vm) {
+  if (VM_RUNNING == status(vm)) vm->trap = trap_at(vm);
+  return status(vm);
+}
+
+// Gives the engines a fault on the accesses to watched pages, see
+// watch_protect().
+static void protect_watches(VM *vm, bool on) {
+#ifdef HAVE_GUARD_PAGES
+  watch_protect(vm, on);
+#endif
+}
+
+VMStatus vm_step(VM *vm) {
+  if (!vm->code) {
+    vm->error = "No program loaded!";
+    vm->failed = true;
+  }
+  vm->trap = TRAP_NONE;
+  if (VM_RUNNING != status(vm)) return status(vm);
+
+  vm->error = NULL;
+  if (0 != prepare_observed(vm) ||
+      (0 != step_over(vm) && TRAP_INPUT != vm->trap))
+    vm->failed = true;
+  if (vm->out_pending && VM_RUNNING != status(vm)) flush_output(vm);
+  return settle(vm);
+}
+
+VMStatus vm_run(VM *vm, uint64_t steps) {
+  uint64_t limit = UINT64_MAX, slice;
+  int (*run)(VM *vm, uint64_t limit);
+  // Stepping over a breakpoint or watchpoint, an IN that waited runs again.
+  bool resume = TRAP_BREAK == vm->trap || TRAP_WATCH == vm->trap;
+  uint64_t start;
+  int ret;
+
+  if (!vm->code) {
+    vm->error = "No program loaded!";
+    vm->failed = true;
+  }
+  vm->trap = TRAP_NONE;
+  if (VM_RUNNING != status(vm)) return status(vm);
+
+  if (steps && vm->steps + steps > vm->steps)
+    limit = vm->steps + steps;
+  vm->error = NULL;
+  if (0 != prepare_observed(vm)) {
+    vm->failed = true;
+    return status(vm);
+  }
+  if (resume && 0 != step_over(vm)) vm->failed = true;
+  if (!observed(vm)) protect_watches(vm, true);
+  // Run in slices, so the output can be flushed in between.
+  while (VM_RUNNING == status(vm) && vm->steps < limit) {
+    slice = limit;
+    if (vm->flush_interval > 0 && limit - vm->steps > FLUSH_SLICE)
+      slice = vm->steps + FLUSH_SLICE;
+
+    switch (vm->engine) {
+#ifdef HAVE_THREADED_ENGINE
+      case VM_ENGINE_THREADED:
+        run = run_threaded;
+        break;
+#endif
+#ifdef HAVE_JIT_ENGINE
+      case VM_ENGINE_JIT:
+        run = run_jit;
+        break;
+#endif
+      default:
+        run = run_call;
+        break;
+    }
+    if (observed(vm))
+      run = run_observed;
+    else if (vm->counters && VM_ENGINE_CALL == vm->engine)
+      run = run_counted;
+    if (vm->counters) counters_start(vm->counters);
+    start = vm->steps;
+    ret = run_engine(vm, run, slice);
+    if (vm->counters) counters_stop(vm->counters, vm->steps - start);
+    if (0 != ret) {
+      if (TRAP_WATCH == vm->trap && TRAP_WATCH != trap_at(vm)) {
+        // Another access to the same pages.
+        vm->trap = TRAP_NONE;
+        protect_watches(vm, false);
+        if (0 != step_over(vm)) vm->failed = true;
+        protect_watches(vm, true);
+      } else if (TRAP_NONE == vm->trap) {
+        vm->failed = true;
+      }
+    }
+
+    if (vm->out_pending && vm->flush_interval > 0 &&
+        now_ms() - vm->last_flush >= (uint64_t)vm->flush_interval)
+      flush_output(vm);
+  }
+  protect_watches(vm, false);
+  if (vm->out_pending && VM_RUNNING != status(vm)) flush_output(vm);
+  return status(vm);
+}
+
+void vm_set_profile(VM *vm, bool on) {
+  vm->profiling = on;
+}
+
+void vm_write_profile(VM *vm, FILE *fp, const char *list_file) {
+  profile_write(vm, fp, list_file);
+}
+
+void vm_set_counters(VM *vm, bool on) {
+  vm->counting = on;
+}
+
+void vm_write_counters(VM *vm, FILE *fp) {
+  counters_write(vm, fp);
+}
+
+void vm_set_trace(VM *vm, size_t size) {
+  if (size == vm->trace_size) return;
+  trace_destroy(vm->trace);
+  vm->trace = NULL;
+  vm->trace_size = size;
+}
+
+int vm_write_trace(VM *vm, int fd) {
+  return trace_write(vm, fd);
+}
+
+int vm_print_trace(FILE *in, FILE *out) {
+  return trace_print(in, out);
+}
+
+void vm_set_history(VM *vm, size_t size) {
+  if (size == vm->history_size) return;
+  history_destroy(vm->history);
+  vm->history = NULL;
+  vm->history_size = size;
+}
+
+// Runs the steps up to limit again, without stopping at breakpoints or
+// watchpoints.
+static int replay(VM *vm, uint64_t limit) {
+  int ret;
+
+  vm->ignore_traps = true;
+  ret = run_engine(vm, run_observed, limit);
+  vm->ignore_traps = false;
+  return ret;
+}
+
+// Goes back to step, undoing the recent steps, or restoring the checkpoint
+// before it and running forward again. Stops at the oldest checkpoint.
+static void rewind_to(VM *vm, uint64_t step) {
+  History *history = vm->history;
+
+  vm->failed = false;
+  vm->error = NULL;
+  vm->trap = TRAP_NONE;
+  while (vm->steps > step && history_undo(history, vm))
+    ;
+  if (vm->steps > step && history_restore(history, vm, step) &&
+      0 != replay(vm, step))
+    vm->failed = true;
+}
+
+VMStatus vm_reverse(VM *vm, uint64_t steps) {
+  if (!vm->history) return status(vm);
+  rewind_to(vm, steps < vm->steps ? vm->steps - steps : 0);
+  return settle(vm);
+}
+
+// Goes back to the last time stop(vm, pc) held before a step, or as far back
+// as the history goes.
+static void reverse_until(VM *vm, bool (*stop)(VM *vm, uint32_t pc),
+                          uint32_t pc) {
+  History *history = vm->history;
+  uint64_t start, end, found;
+
+  vm->failed = false;
+  vm->error = NULL;
+  vm->trap = TRAP_NONE;
+  for (;;) {
+    while (history_undo(history, vm))
+      if (stop(vm, pc)) return;
+
+    // Before the undo log, search from the checkpoint before.
+    end = vm->steps;
+    if (0 == end || !history_restore(history, vm, end - 1) ||
+        vm->steps == end)
+      return;
+    start = found = vm->steps;
+    while (vm->steps < end) {
+      if (stop(vm, pc)) found = vm->steps + 1;
+      if (0 != replay(vm, vm->steps + 1)) {
+        vm->failed = true;
+        return;
+      }
+    }
+    if (found != start) {
+      rewind_to(vm, found - 1);
+      return;
+    }
+    rewind_to(vm, start);
+    if (VM_ERROR == status(vm)) return;
+  }
+}
+
+static bool at_pc(VM *vm, uint32_t pc) {
+  return vm->PC == pc;
+}
+
+static bool at_trap(VM *vm, uint32_t pc) {
+  return TRAP_NONE != trap_at(vm);
+}
+
+VMStatus vm_reverse_to(VM *vm, uint32_t pc) {
+  if (!vm->history) return status(vm);
+  reverse_until(vm, at_pc, pc);
+  return settle(vm);
+}
+
+VMStatus vm_reverse_continue(VM *vm) {
+  if (!vm->history) return status(vm);
+  reverse_until(vm, at_trap, 0);
+  return settle(vm);
+}
+
+int vm_set_break(VM *vm, uint32_t pc, bool on) {
+  uint32_t i = pc / 4;
+  Instr *instr;
+
+  if (!vm->code || pc % 4 || pc >= vm->CS_SIZE) return -1;
+  // Superinstructions running over it wouldn't call its handler, split them.
+  for (uint32_t k = i > 2 ? i - 2 : 0; on && k < i; ++k) {
+    instr = &vm->code[k];
+    if (k + instr_length(instr->opcode) <= i) continue;
+    instr->opcode = base_opcode(instr->opcode);
+    if (do_break != instr->handler) instr->handler = handler_of(vm, instr);
+  }
+  instr = &vm->code[i];
+  instr->handler = on ? do_break : handler_of(vm, instr);
+
+  // The engines work from what they worked out from the decoded code.
+  free(vm->run_len);
+  vm->run_len = NULL;
+  free(vm->thread);
+  vm->thread = NULL;
+#ifdef HAVE_JIT_ENGINE
+  jit_destroy(vm);
+#endif
+  return 0;
+}
+
+int vm_set_watch(VM *vm, int32_t index, uint32_t size, VMWatch kind, bool on) {
+  return watch_set(vm, index, size, kind, on);
+}
+
+bool vm_watch_hit(VM *vm, int32_t *index) {
+  if (TRAP_WATCH != vm->trap) return false;
+  *index = vm->watch_index;
+  return true;
+}
+
+int16_t vm_reg(VM *vm, int r) {
+  return vm->general_regs[r & 7];
+}
+
+int vm_psw(VM *vm) {
+  return get_of(vm) | vm->PSW.CF << 1;
+}
+
+// FNV-1a, going on from h.
+static uint64_t hash_bytes(uint64_t h, const uint8_t *p, size_t size) {
+  for (size_t k = 0; k < size; ++k) {
+    h ^= p[k];
+    h *= 0x100000001b3;
+  }
+  return h;
+}
+
+void vm_get_state(VM *vm, VMState *state) {
+  const uint64_t basis = 0xcbf29ce484222325;
+
+  memset(state, 0, sizeof(VMState));
+  if (!vm->code) return;
+  memcpy(state->regs, vm->general_regs, sizeof(state->regs));
+  state->pc = vm->PC;
+  state->psw = vm_psw(vm);
+  state->ss_top = vm->SS_TOP;
+  state->es_top = vm->ES_TOP;
+  state->ds_hash = hash_bytes(basis, vm->DS, vm->DS_SIZE);
+  // A fault can leave a top past the end.
+  state->stack_hash = hash_bytes(basis, vm->SS, vm->SS_TOP <= vm->ss_size ?
+                                                vm->SS_TOP : 0);
+  state->stack_hash = hash_bytes(state->stack_hash, vm->ES,
+                                 vm->ES_TOP <= vm->es_size ? vm->ES_TOP : 0);
+}
+
+int vm_read(VM *vm, int32_t index, void *buf, size_t size) {
+  if (!vm->code || index < 0 || size > vm->DS_SIZE ||
+      (uint32_t)index > vm->DS_SIZE - size)
+    return -1;
+  memcpy(buf, vm->DS + index, size);
+  return 0;
+}
+
+int vm_save(VM *vm, const char *file_name) {
+  if (vm->out_pending) flush_output(vm);
+  return snapshot_save(vm, file_name);
+}
+
+const char *vm_error(VM *vm) {
+  return vm->error;
+}
+
+uint32_t vm_pc(VM *vm) {
+  return vm->PC;
+}
+
+uint64_t vm_steps(VM *vm) {
+  return vm->steps;
+}
+
+void vm_destroy(VM *vm) {
+  if (!vm) return;
+  if (vm->out_pending) flush_output(vm);
+  unload(vm);
+  free(vm);
+}
@@ -0,0 +1,176 @@
+#ifndef _VM_H_
+#define _VM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "libssim.h"
+
+// Default sizes of SS and ES, see vm_set_stack_sizes().
+#define STACK_SIZE ((size_t)1 << 20)
+#define ES_SIZE ((size_t)1 << 20)
+#define MAX_STACK_SIZE ((size_t)1 << 30)
+
+#define CACHE_LINE_SIZE 64
+
+// Instruction codes.
+typedef enum Opcode {
+  OP_HLT, OP_JMP, OP_CJMP, OP_OJMP, OP_CALL,
+  OP_RET, OP_PUSH, OP_POP, OP_LOADB, OP_LOADW,
+  OP_STOREB, OP_STOREW, OP_LOADI, OP_NOP, OP_IN,
+  OP_OUT, OP_ADD, OP_ADDI, OP_SUB, OP_SUBI,
+  OP_MUL, OP_DIV, OP_AND, OP_OR, OP_NOR,
+  OP_NOTB, OP_SAL, OP_SAR, OP_EQU, OP_LT,
+  OP_LTE, OP_NOTC,
+
+  // Superinstructions, see fuse_cs().
+  OP_LT_CJMP, OP_LTE_CJMP, OP_EQU_CJMP, OP_EQU_NOTC_CJMP, OP_ADDI_LT_CJMP,
+} Opcode;
+
+// What stopped a run before the next instruction, see vm_set_break().
+typedef enum Trap {
+  TRAP_NONE,
+  TRAP_BREAK,  // A breakpoint on it.
+  TRAP_WATCH,  // It accesses a watched DS range.
+  TRAP_INPUT,  // It's an IN with nothing to read, see vm_set_feed().
+} Trap;
+
+typedef struct Instr Instr;
+
+// Handlers return non-zero on error, optionally setting vm->error.
+typedef int handler_t(VM *vm, const Instr *instr);
+
+// A pre-decoded instruction.
+// The code segment is decoded once at load time, so the run loop never has
+// to fetch and pick apart the raw instruction code again.
+struct Instr {
+  handler_t *handler;
+  union {
+    uint32_t addr;
+    uint16_t immediate;
+    uint8_t port;
+  };
+  uint8_t reg0;
+  uint8_t reg1;
+  uint8_t reg2;
+  uint8_t opcode;
+};
+
+// What CALL saves on ES, and RET restores.
+typedef struct Frame {
+  int16_t general_regs[8];
+  uint32_t PC;   // Of the CALL.
+  uint32_t PSW;  // OF | CF << 1.
+} Frame;
+
+struct Jit;
+struct Profile;
+struct Counters;
+struct Trace;
+struct History;
+struct Watch;
+
+// The struct represents the states of a running virtual machine.
+// What the handlers touch comes first, in one cache line of its own, and
+// what the loop of the call engine touches starts the next one. It's never
+// written anywhere as it is, CALL saves a Frame and vm_save() a snapshot, so
+// it's laid out for speed only.
+struct VM {
+  _Alignas(CACHE_LINE_SIZE)
+  int16_t general_regs[8]; // Z:0 A:1 B:2 C:3 D:4 E:5 F:6 G:7
+  uint32_t PC;
+  uint32_t SS_TOP;
+  uint32_t ES_TOP;
+  struct {
+    // Of the last arithmetic instruction, OF is worked out from it only when
+    // it's read, see get_of().
+    int32_t result;
+    uint8_t CF;  // A byte of its own, so setting it is a plain store.
+  } PSW;
+  bool stopped;
+  uint8_t *DS;
+  uint8_t *SS;
+  uint8_t *ES; // Uses to store a copy of general_regs during function calls.
+
+  _Alignas(CACHE_LINE_SIZE)
+  Instr *code; // The decoded CS, with a trailing sentinel.
+  uint64_t steps;    // Instructions run so far.
+  uint32_t *run_len; // Instructions to the end of every straight-line run.
+  bool out_pending;    // OUT wrote something that wasn't flushed yet.
+
+  uint8_t *CS;
+
+  // DS and SS live in these areas, surrounded by guard regions.
+  uint8_t *ds_area;
+  size_t ds_area_size;
+  uint8_t *ss_area;
+  size_t ss_area_size;
+  uint8_t *es_area;
+  size_t es_area_size;
+
+  uint32_t CS_SIZE;
+  uint32_t DS_SIZE;
+  size_t ss_size;  // Bytes SS and ES can grow to.
+  size_t es_size;
+
+  bool failed;
+
+  FILE *in;
+  FILE *out;
+  // What vm_feed() gave IN, when it reads that instead of in.
+  bool feeding;
+  bool fed_all;        // No more is coming.
+  uint8_t *feed;
+  size_t feed_pos;
+  size_t feed_size;
+  size_t feed_cap;
+  int flush_interval;  // Milliseconds, see vm_set_flush_interval().
+  uint64_t last_flush; // Milliseconds.
+  const char *error; // Message of the last error.
+
+  VMEngine engine;
+  bool fuse;
+  void **thread;     // Label of every instruction, for the threaded engine.
+  struct Jit *jit;
+
+  bool profiling;
+  struct Profile *profile;
+  bool counting;     // Reading the host counters, see vm_set_counters().
+  struct Counters *counters;
+  size_t trace_size; // Bytes of the trace ring buffer, 0 when not tracing.
+  struct Trace *trace;
+  size_t history_size; // Bytes for going back in time, 0 when off.
+  struct History *history;
+
+  uint8_t trap;         // What stopped the last run, a Trap.
+  bool ignore_traps;    // Set while stepping over one, or running steps again.
+  struct Watch *watches;
+  size_t watch_num;
+  int32_t watch_index;  // DS index the instruction stopped by a watch accesses.
+};
+
+// Whether the last arithmetic instruction overflowed 16 bits.
+static inline bool get_of(const VM *vm) {
+  return vm->PSW.result != (int16_t)vm->PSW.result;
+}
+
+// Sets OF as if the last arithmetic instruction did or didn't overflow.
+static inline void set_of(VM *vm, bool of) {
+  vm->PSW.result = of ? 0x8000 : 0;
+}
+
+// The number of instructions a (super)instruction runs.
+int instr_length(Opcode opcode);
+
+// The first instruction of a superinstruction.
+Opcode base_opcode(Opcode opcode);
+
+// Whether the instruction ends a basic block.
+bool is_block_end(Opcode opcode);
+
+// The handler of an instruction with a breakpoint, it stops the engine right
+// before the instruction.
+handler_t do_break;
+
+#endif
@@ -0,0 +1,132 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+#include "guard.h"
+#include "watch.h"
+
+#ifdef HAVE_GUARD_PAGES
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+int watch_set(VM *vm, int32_t index, uint32_t size, VMWatch kind, bool on) {
+#ifdef HAVE_GUARD_PAGES
+  Watch *watches;
+  size_t k;
+
+  if (!vm->code || index < 0 || 0 == size || size > vm->DS_SIZE ||
+      (uint32_t)index > vm->DS_SIZE - size)
+    return -1;
+  for (k = 0; k < vm->watch_num; ++k) {
+    Watch *watch = &vm->watches[k];
+
+    if (watch->index == index && watch->size == size && watch->kind == kind)
+      break;
+  }
+
+  if (!on) {
+    if (k < vm->watch_num) vm->watches[k] = vm->watches[--vm->watch_num];
+    return 0;
+  }
+  if (k < vm->watch_num) return 0;
+  watches = realloc(vm->watches, (vm->watch_num + 1) * sizeof(Watch));
+  if (!watches) return -1;
+  vm->watches = watches;
+  vm->watches[vm->watch_num++] = (Watch){index, size, kind};
+  return 0;
+#else
+  // The engines can only catch the accesses with page protection.
+  return -1;
+#endif
+}
+
+bool watch_hit(VM *vm, const Instr *instr, int32_t *index) {
+  int32_t g = vm->general_regs[7], at;
+  int size = 1;
+  bool store = false;
+
+  switch (base_opcode(instr->opcode)) {
+    case OP_STOREB:
+      store = true;
+      // Fall through.
+    case OP_LOADB:
+      at = (int32_t)instr->addr + g;
+      break;
+    case OP_STOREW:
+      store = true;
+      // Fall through.
+    case OP_LOADW:
+      at = (int32_t)instr->addr + g * 2;
+      size = 2;
+      break;
+    default:
+      return false;
+  }
+
+  for (size_t k = 0; k < vm->watch_num; ++k) {
+    Watch *watch = &vm->watches[k];
+
+    if (at < watch->index + (int64_t)watch->size && at + size > watch->index &&
+        (store || VM_WATCH_ACCESS == watch->kind)) {
+      *index = at;
+      return true;
+    }
+  }
+  return false;
+}
+
+#ifdef HAVE_GUARD_PAGES
+static uintptr_t page_down(const void *p) {
+  return (uintptr_t)p & ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1);
+}
+
+static uintptr_t page_up(const void *p) {
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+
+  return ((uintptr_t)p + page - 1) & ~(page - 1);
+}
+
+// The pages holding the range of watch.
+static void pages_of(VM *vm, const Watch *watch, uintptr_t *start,
+                     uintptr_t *end) {
+  *start = page_down(vm->DS + watch->index);
+  *end = page_up(vm->DS + watch->index + watch->size);
+}
+
+void watch_protect(VM *vm, bool on) {
+  uint8_t *data = vm->ds_area + DS_GUARD;
+  uintptr_t start, end;
+
+  if (!vm->watch_num) return;
+  mprotect(data, page_up(vm->DS + vm->DS_SIZE) - (uintptr_t)data,
+           PROT_READ | PROT_WRITE);
+  if (!on) return;
+
+  // Pages shared by both kinds end up inaccessible.
+  for (int pass = 0; pass < 2; ++pass) {
+    VMWatch kind = pass ? VM_WATCH_ACCESS : VM_WATCH_WRITE;
+
+    for (size_t k = 0; k < vm->watch_num; ++k) {
+      if (vm->watches[k].kind != kind) continue;
+      pages_of(vm, &vm->watches[k], &start, &end);
+      mprotect((void *)start, end - start,
+               VM_WATCH_WRITE == kind ? PROT_READ : PROT_NONE);
+    }
+  }
+}
+
+bool watch_fault(VM *vm, const void *addr) {
+  uintptr_t start, end;
+
+  for (size_t k = 0; k < vm->watch_num; ++k) {
+    pages_of(vm, &vm->watches[k], &start, &end);
+    if ((uintptr_t)addr >= start && (uintptr_t)addr < end) return true;
+  }
+  return false;
+}
+#endif
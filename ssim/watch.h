@@ -0,0 +1,34 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "vm.h"
+#include "guard.h"
+
+// A watched DS range.
+typedef struct Watch {
+  int32_t index;
+  uint32_t size;
+  VMWatch kind;
+} Watch;
+
+// Adds or removes a watch, see vm_set_watch().
+int watch_set(VM *vm, int32_t index, uint32_t size, VMWatch kind, bool on);
+
+// Whether instr, about to run, accesses a watched range the way its watch
+// looks for. Stores the DS index it accesses in *index.
+bool watch_hit(VM *vm, const Instr *instr, int32_t *index);
+
+#ifdef HAVE_GUARD_PAGES
+// Protects the pages of the watched ranges, so the engines fault on accesses
+// to them without checking anything themselves, or gives the pages back their
+// access.
+void watch_protect(VM *vm, bool on);
+
+// Whether the fault at addr is in a page protected for a watch.
+bool watch_fault(VM *vm, const void *addr);
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+Instructions run: 8
+
+Hottest instructions:
+       count       %       taken/not taken      PC  source
+           1  12.50%                             0            LOADI    A        1
+           1  12.50%                             4            LOADI    B        2
+           1  12.50%                             8            LT       A        B
+           1  12.50%                   1/0      12            CJMP     NEXT1
+           1  12.50%                            16  NEXT1:    LOADI    C        32767
+           1  12.50%                            20            ADDI     C        1
+           1  12.50%                   1/0      24            OJMP     NEXT2
+           1  12.50%                            28  NEXT2:    HLT
+
+All instructions:
+       count       %       taken/not taken      PC  source
+           1  12.50%                             0            LOADI    A        1
+           1  12.50%                             4            LOADI    B        2
+           1  12.50%                             8            LT       A        B
+           1  12.50%                   1/0      12            CJMP     NEXT1
+           1  12.50%                            16  NEXT1:    LOADI    C        32767
+           1  12.50%                            20            ADDI     C        1
+           1  12.50%                   1/0      24            OJMP     NEXT2
+           1  12.50%                            28  NEXT2:    HLT
+
+Opcodes:
+           1  12.50%  HLT
+           1  12.50%  CJMP
+           1  12.50%  OJMP
+           3  37.50%  LOADI
+           1  12.50%  ADDI
+           1  12.50%  LT
+
+Calls:
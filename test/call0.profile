@@ -0,0 +1,44 @@
+Instructions run: 32
+
+Hottest instructions:
+       count       %       taken/not taken      PC  source
+           3   9.38%                             0  TOP:      LOADW    A        N
+           3   9.38%                             4            ADDI     A        1
+           3   9.38%                             8            STOREW   A        N
+           3   9.38%                            12            LOADI    B        48
+           3   9.38%                            16            ADD      B        B       A
+           3   9.38%                            20            OUT      B        15
+           3   9.38%                            24            LOADI    C        3
+           3   9.38%                            28            LT       A        C
+           3   9.38%                   2/1      32            CJMP     AGAIN
+           2   6.25%                            40  AGAIN:    CALL     TOP
+
+All instructions:
+       count       %       taken/not taken      PC  source
+           3   9.38%                             0  TOP:      LOADW    A        N
+           3   9.38%                             4            ADDI     A        1
+           3   9.38%                             8            STOREW   A        N
+           3   9.38%                            12            LOADI    B        48
+           3   9.38%                            16            ADD      B        B       A
+           3   9.38%                            20            OUT      B        15
+           3   9.38%                            24            LOADI    C        3
+           3   9.38%                            28            LT       A        C
+           3   9.38%                   2/1      32            CJMP     AGAIN
+           1   3.12%                            36            RET
+           2   6.25%                            40  AGAIN:    CALL     TOP
+           2   6.25%                            44            RET
+
+Opcodes:
+           3   9.38%  CJMP
+           2   6.25%  CALL
+           3   9.38%  RET
+           3   9.38%  LOADW
+           3   9.38%  STOREW
+           6  18.75%  LOADI
+           3   9.38%  OUT
+           3   9.38%  ADD
+           3   9.38%  ADDI
+           3   9.38%  LT
+
+Calls:
+           2       0  TOP